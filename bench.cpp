@@ -0,0 +1,352 @@
+/**
+ * Benchmarks the conversion stages on synthetic MuseScore-like scores (or on files given on the command line).
+ * It is built from the library source itself so that the stages inside parse() can be timed on their own.
+ *
+ * ./mpbench                       runs the default suite
+ * ./mpbench --parts 4 --measures 5000 --voices 2 --subdivisions --dots --seed 7 --reps 5
+ * ./mpbench --emit score.xml ...  writes the generated score instead of timing it
+ * ./mpbench a.xml b.xml           times existing files
+ */
+#include "musicparse.cpp"
+
+#include <chrono>
+#include <cstdarg>
+#include <sys/resource.h>
+
+typedef struct __genparams__ {
+    uint32_t parts;
+    uint32_t measures;
+    uint8_t voices; // Voices in the first part (1 or 2).
+    bool subdivisions; // Eighth and sixteenth notes.
+    bool dots; // Dotted rhythms.
+    uint32_t seed;
+} gen_params;
+
+typedef struct __rng__ {
+    uint32_t state;
+} rng;
+
+uint32_t next_rand(rng* r, uint32_t bound) {
+    // xorshift32; plenty for picking rhythms and pitches.
+    r->state ^= r->state << 13;
+    r->state ^= r->state >> 17;
+    r->state ^= r->state << 5;
+    return r->state % bound;
+}
+
+void append_f(std::string& out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void append_f(std::string& out, const char* fmt, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (n > 0) out.append(line, (size_t) n < sizeof(line) ? (size_t) n : sizeof(line) - 1);
+}
+
+/**
+ * Fills one voice of a measure of total divisions with a random rhythm.
+ */
+void fill_rhythm(rng* r, const gen_params* gp, uint16_t total, uint16_t div, std::vector<uint16_t>& durations) {
+    durations.clear();
+    uint16_t left = total;
+    while (left > 0) {
+        uint32_t pick = next_rand(r, 6);
+        if (pick == 0 && left >= 2 * div) {
+            durations.push_back(2 * div);
+            left -= 2 * div;
+        } else if (pick == 1 && gp->subdivisions) {
+            durations.push_back(div / 2);
+            durations.push_back(div / 2);
+            left -= div;
+        } else if (pick == 2 && gp->subdivisions && div % 4 == 0) {
+            durations.push_back(div / 4);
+            durations.push_back(div / 4);
+            durations.push_back(div / 2);
+            left -= div;
+        } else if (pick == 3 && gp->dots && left >= 2 * div) {
+            durations.push_back(div + div / 2);
+            durations.push_back(div / 2);
+            left -= 2 * div;
+        } else {
+            durations.push_back(div);
+            left -= div;
+        }
+    }
+}
+
+void append_note(std::string& out, rng* r, uint16_t duration, uint16_t div, uint8_t voice, uint8_t octave) {
+    static const char steps[] = "CDEFGAB";
+    append_f(out, "      <note default-x=\"%u.%02u\" default-y=\"-%u\">\n", 10 + next_rand(r, 290), next_rand(r, 100), next_rand(r, 40));
+    append_f(out, "        <pitch>\n          <step>%c</step>\n", steps[next_rand(r, 7)]);
+    uint32_t alter = next_rand(r, 6);
+    if (alter == 0) out += "          <alter>1</alter>\n";
+    if (alter == 1) out += "          <alter>-1</alter>\n";
+    append_f(out, "          <octave>%u</octave>\n          </pitch>\n", octave + (next_rand(r, 3) == 0));
+    append_f(out, "        <duration>%u</duration>\n        <voice>%u</voice>\n", duration, voice);
+    append_f(out, "        <type>%s</type>\n", duration >= 2 * div ? "half" : duration >= div ? "quarter" : "eighth");
+    if (duration == div + div / 2) out += "        <dot/>\n";
+    append_f(out, "        <stem>%s</stem>\n", next_rand(r, 2) ? "up" : "down");
+    if (next_rand(r, 5) == 0) out += "        <notations>\n          <fermata type=\"upright\"/>\n          </notations>\n";
+    if (next_rand(r, 3) == 0) out += "        <lyric number=\"1\">\n          <syllabic>single</syllabic>\n          <text>la</text>\n          </lyric>\n";
+    out += "        </note>\n";
+}
+
+/**
+ * Generates a partwise score in 4/4 with the layout and text noise MuseScore exports carry.
+ */
+std::string generate_score(const gen_params* gp) {
+    rng r;
+    r.state = gp->seed ? gp->seed : 1;
+    uint16_t div = gp->subdivisions ? 4 : 2;
+    uint16_t total = 4 * div;
+
+    std::string out;
+    out += "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n";
+    out += "<!DOCTYPE score-partwise PUBLIC \"-//Recordare//DTD MusicXML 3.1 Partwise//EN\" \"http://www.musicxml.org/dtds/partwise.dtd\">\n";
+    out += "<score-partwise version=\"3.1\">\n";
+    out += "  <identification>\n    <encoding>\n      <software>MuseScore 3.6.2</software>\n      </encoding>\n    </identification>\n";
+    out += "  <defaults>\n    <scaling>\n      <millimeters>7</millimeters>\n      <tenths>40</tenths>\n      </scaling>\n    </defaults>\n";
+    out += "  <part-list>\n";
+    for (uint32_t p = 1; p <= gp->parts; p++) {
+        append_f(out, "    <score-part id=\"P%u\">\n      <part-name>Voice %u</part-name>\n      </score-part>\n", p, p);
+    }
+    out += "    </part-list>\n";
+
+    int fifths = (int) next_rand(&r, 15) - 7;
+    std::vector<uint16_t> durations;
+    for (uint32_t p = 0; p < gp->parts; p++) {
+        uint8_t octave = (uint8_t) (2 + (gp->parts - p) * 3 / gp->parts);
+        uint8_t voices = (p == 0 && gp->voices > 1) ? 2 : 1;
+
+        append_f(out, "  <part id=\"P%u\">\n", p + 1);
+        for (uint32_t m = 1; m <= gp->measures; m++) {
+            append_f(out, "    <measure number=\"%u\" width=\"%u.%02u\">\n", m, 100 + next_rand(&r, 300), next_rand(&r, 100));
+            if (m == 1) {
+                out += "      <print>\n        <system-layout>\n          <system-margins>\n            <left-margin>50.00</left-margin>\n            </system-margins>\n          </system-layout>\n        </print>\n";
+                append_f(out, "      <attributes>\n        <divisions>%u</divisions>\n        <key>\n          <fifths>%d</fifths>\n          <mode>major</mode>\n          </key>\n", div, fifths);
+                out += "        <time>\n          <beats>4</beats>\n          <beat-type>4</beat-type>\n          </time>\n        </attributes>\n";
+                out += "      <direction placement=\"above\">\n        <direction-type>\n          <words>Andante</words>\n          </direction-type>\n        </direction>\n";
+            }
+            for (uint8_t v = 1; v <= voices; v++) {
+                if (v > 1) append_f(out, "      <backup>\n        <duration>%u</duration>\n        </backup>\n", total);
+                fill_rhythm(&r, gp, total, div, durations);
+                for (uint16_t d : durations) append_note(out, &r, d, div, v, octave);
+            }
+            out += "      </measure>\n";
+        }
+        out += "    </part>\n";
+    }
+    out += "  </score-partwise>\n";
+    return out;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+long peak_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+/**
+ * Feeds the document through the tokenizer and, optionally, init_parse and note_parse, the way
+ * parse_document does. Returns the number of events seen.
+ */
+size_t run_parse(parse_context* ctx, const input_buffer* input, bool with_init, bool with_notes) {
+    parse_state ps;
+    init_parse_state(&ps, ctx, NULL);
+
+    xml_tokenizer tk;
+    init_tokenizer(&tk, input);
+
+    xml_event ev;
+    size_t events = 0;
+    while (next_event(&tk, &ev)) {
+        events++;
+        if (ev.type == XML_OPEN && ev.id == T_PART) ps.part = part_index(&ps, &ev);
+        if (with_init) init_parse(&ps, &ev);
+        if (with_notes) note_parse(&ps, &ev);
+    }
+    return events;
+}
+
+/**
+ * Copies every part's measures out of the parsed arrays, as merge_row does, with or without running
+ * handle_dots on them.
+ */
+void run_dots(parse_context* ctx, bool with_dots) {
+    merge_work& work = ctx->work;
+    for (const auto& filed : ctx->filed_measures) {
+        const chord* first = ctx->parsed.chords.data() + filed.span.offset;
+        clear_beats(work.part);
+        append_beats(work.part.notes, work.part.chords, ctx->parsed.notes, first, first + filed.span.count);
+        if (with_dots) handle_dots(ctx, work.part);
+    }
+}
+
+void report(const char* stage, double secs, size_t bytes, size_t notes) {
+    if (secs < 1e-9) secs = 1e-9;
+    printf("  %-14s %9.2f ms %10.1f MB/s %10.2f Mnotes/s\n", stage, secs * 1e3, bytes / secs / 1e6, notes / secs / 1e6);
+}
+
+/**
+ * Times each stage reps times on one document and prints the best run of each.
+ */
+void bench_document(const char* name, const input_buffer* input, int reps) {
+    parse_context ctx;
+    init_context(&ctx);
+    render_options opts;
+    opts.ml_flag = false;
+    opts.tokens = false;
+    opts.key_override = NULL;
+    opts.repeats = 0;
+    opts.stats = NULL;
+
+    double tokenize = 1e9, init = 1e9, full = 1e9, dots = 1e9, copy = 1e9, merge = 1e9, display = 1e9;
+    size_t notes = 0, out_bytes = 0, measures = 0;
+    std::string text;
+    for (int rep = 0; rep < reps; rep++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        run_parse(&ctx, input, false, false);
+        tokenize = std::min(tokenize, seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        run_parse(&ctx, input, true, false);
+        init = std::min(init, seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        run_parse(&ctx, input, true, true);
+        full = std::min(full, seconds_since(start));
+        notes = ctx.parsed.notes.size();
+
+        start = std::chrono::steady_clock::now();
+        run_dots(&ctx, false);
+        copy = std::min(copy, seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        run_dots(&ctx, true);
+        dots = std::min(dots, seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        merge_measures(&ctx);
+        merge = std::min(merge, seconds_since(start));
+        measures = ctx.piece.measures.size();
+
+        start = std::chrono::steady_clock::now();
+        render(&ctx.piece, &opts, &text);
+        display = std::min(display, seconds_since(start));
+        out_bytes = text.size();
+    }
+
+    printf("%s: %.1f MB, %zu notes, %zu measures, %.1f MB out, best of %d\n", name, input->size / 1e6, notes, measures, out_bytes / 1e6, reps);
+    report("tokenize", tokenize, input->size, notes);
+    report("init_parse", std::max(init - tokenize, 0.0), input->size, notes);
+    report("note_parse", std::max(full - init, 0.0), input->size, notes);
+    report("handle_dots", std::max(dots - copy, 0.0), input->size, notes);
+    report("merge_measures", merge, input->size, notes);
+    report("display", display, input->size, notes);
+    report("total", full + merge + display, input->size, notes);
+    printf("  peak RSS so far %.1f MB\n\n", peak_rss_kb() / 1024.0);
+}
+
+void bench_generated(const char* name, const gen_params* gp, int reps) {
+    std::string xml = generate_score(gp);
+    input_buffer input;
+    input.data = xml.data();
+    input.size = xml.size();
+    input.mapped = false;
+    bench_document(name, &input, reps);
+}
+
+int main(int argc, char** argv) {
+    gen_params gp;
+    gp.parts = 4;
+    gp.measures = 2000;
+    gp.voices = 1;
+    gp.subdivisions = false;
+    gp.dots = false;
+    gp.seed = 1;
+    int reps = 3;
+    bool custom = false;
+    const char* emit = NULL;
+    std::vector<const char*> files;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--parts") == 0 && i + 1 < argc) {
+            gp.parts = (uint32_t) atoi(argv[++i]);
+            custom = true;
+        } else if (strcmp(argv[i], "--measures") == 0 && i + 1 < argc) {
+            gp.measures = (uint32_t) atoi(argv[++i]);
+            custom = true;
+        } else if (strcmp(argv[i], "--voices") == 0 && i + 1 < argc) {
+            gp.voices = (uint8_t) atoi(argv[++i]);
+            custom = true;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            gp.seed = (uint32_t) atoi(argv[++i]);
+            custom = true;
+        } else if (strcmp(argv[i], "--subdivisions") == 0) {
+            gp.subdivisions = true;
+            custom = true;
+        } else if (strcmp(argv[i], "--dots") == 0) {
+            gp.dots = true;
+            custom = true;
+        } else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            reps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--emit") == 0 && i + 1 < argc) {
+            emit = argv[++i];
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (gp.parts == 0 || gp.parts > 64 || reps < 1) return 1;
+
+    if (emit) {
+        std::string xml = generate_score(&gp);
+        FILE* out = fopen(emit, "w");
+        if (!out) return 1;
+        fwrite(xml.data(), 1, xml.size(), out);
+        return fclose(out) != 0;
+    }
+
+    if (!files.empty()) {
+        for (const char* path : files) {
+            input_buffer input;
+            if (open_input(path, &input) != 0) {
+                fprintf(stderr, "mpbench: cannot read %s\n", path);
+                return 1;
+            }
+            bench_document(path, &input, reps);
+            close_input(&input);
+        }
+        return 0;
+    }
+
+    if (custom) {
+        bench_generated("generated", &gp, reps);
+        return 0;
+    }
+
+    // The default suite, smallest first so the peak RSS figures stay meaningful.
+    gen_params chorale = gp;
+    chorale.measures = 40;
+    bench_generated("chorale (4 parts x 40 measures)", &chorale, 50);
+
+    gen_params plain = gp;
+    plain.measures = 20000;
+    bench_generated("plain (4 parts x 20000 measures)", &plain, reps);
+
+    gen_params rhythmic = plain;
+    rhythmic.subdivisions = true;
+    rhythmic.dots = true;
+    bench_generated("rhythmic (subdivisions, dots)", &rhythmic, reps);
+
+    gen_params voiced = rhythmic;
+    voiced.parts = 8;
+    voiced.measures = 10000;
+    voiced.voices = 2;
+    bench_generated("voiced (8 parts, 2 voices)", &voiced, reps);
+    return 0;
+}
@@ -1,36 +1,19 @@
-#include <iostream>
-#include <string>
-#include <fstream>
-#include <algorithm>
-#include <vector>
-#include <map>
-#include <cstdint>
-#include <deque>
+#include "musicparse.h"
 
-#define S_DIVISIONS "divisions"
-#define S_BEAT_TYPE "beat-type"
-#define S_FIFTHS "fifths"
-#define S_MODE "mode"
-#define S_BEATS "beats"
-
-#define S_CLOSE_ATTR "/attributes"
-
-#define S_PART "part"
-#define S_ID "id"
-#define S_MEASURE "measure"
-#define S_NUMBER "number"
-#define S_NOTE "note"
-#define S_PITCH "pitch"
-#define S_STEP "step"
-#define S_OCTAVE "octave"
-#define S_ALTER "alter"
-#define S_DURATION "duration"
-#define S_VOICE "voice"
-#define S_REST "rest"
-
-#define S_CLOSE_NOTE "/note"
-#define S_CLOSE_MEASURE "/measure"
-#define S_CLOSE_PART "/part"
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
 
 /**
  * This small C++ program converts MusicXMLs into readable formats for dataset processing.
@@ -60,650 +43,1022 @@
  * (no durations with multiples of 3, for example, unfortunately).
  *
  * The command line is in the form ./a.out {filename} {flag}. If no flag is specified then the ML option is turned off.
- * If it is any other value it will turn on the ML option.
+ * If it is any other value it will turn on the ML option. ./a.out --stream {filename} {flag} writes each measure
+ * as soon as every part has delivered it, --stats reports stage times and counters as JSON on stderr and
+ * --cache {dir} serves unchanged inputs from a conversion cache. --emit-score {file} saves the merged score to
+ * a score file instead, which can then be given in place of the MusicXML to render it without parsing.
+ * --tokens writes token IDs as a .npy array instead of text, and --vocab {file} writes their vocabulary.
+ * --repeats {n|all} writes a measure that repeats one of the last n as a reference to it, and --expand {file}
+ * writes such a file back out in full.
  */
 
-typedef enum {
-    TAG,
-    BEATS, // # of Beats in a measure
-    BEAT_TYPE, // Subdivisions
-    DIVISIONS, // # Divisions Per "Duration"
-    KEY_T, // KEY TONIC
-    KEY_M // KEY MODALITY
-} init_state;
-
-typedef enum {
-    PART, // Detect part
-    PART_ID,
-    MEASURE, // If <measure> tag is reached
-    MEASURE_NUM, // Retrieving measure number
-    NOTE, // When <note> tag is reached
-    PITCH, // When <Pitch> tag is reached
-    STEP, // When <step> tag is reached (indicates actual pitch)
-    ALTER, // Indicates accidental.
-    OCTAVE, // When <octave> tag is reached.
-    DURATION, // Indicates length of note (use division by init_params)
-    VOICE // Indicates what voice this is in if the voice itself is polyphonic.
-} note_state;
-
-typedef struct __initparams__ {
-    uint16_t beats; // # Beats in a Measure
-    uint16_t beat_type; // Beat Subdivision
-    uint8_t division_count; // Division Count
-    int8_t key_center; // Key Center, represented by # Fifths
-    bool major; // Modality (Major = True, Minor = False)
-} init_params;
-
-typedef struct __note__ {
-    uint8_t octave;
-    uint8_t duration;
-    uint8_t part;
-    uint8_t voice;
-    int8_t alter;
-    char pitch;
-} note;
-
-typedef struct __notegroup__ {
-    std::deque<note> voices; // Notes that are part of the chord. Can include passing tones.
-    uint16_t duration; // The length of the chord. Should be a multiple of 2 but can be a multiple of 3.
-    uint8_t part; // The part which this note group is in.
-} chord;
-
-typedef struct __measure__ {
-    std::deque<chord> beat_content; // Contains the content for each beat.
-    uint32_t measure_num; // measure number. This is used to index into measure list.
-} measure;
-
-// Global headers.
-bool ml_flag = true;
-
-std::vector<init_params> part_params;
-std::deque<measure> measure_list;
-std::map<int8_t, std::string> major_map = {
-        {0, "C"}, {1, "G"}, {2, "D"}, {3, "A"}, {4, "E"}, {5, "B"}, {6, "F#"}, {7, "C#"},
-        {-1, "F"}, {-2, "B♭"}, {-3, "E♭"}, {-4, "A♭"}, {-5, "D♭"}, {-6, "G♭"}, {-7, "C♭"}
-};
-std::map<int8_t, std::string> minor_map = {
-        {0, "a"}, {1, "e"}, {2, "b"}, {3, "f#"}, {4, "c#"}, {5, "g#"}, {6, "d#"}, {7, "a#"},
-        {-1, "d"}, {-2, "g"}, {-3, "c"}, {-4, "f"}, {-5, "b♭"}, {-6, "e♭"}, {-7, "a♭"}
-};
-std::map<int8_t, std::string> accidental_map = {
-        {0, "♮"}, {1, "#"}, {-1, "♭"}, {2, "x"}, {-2, "♭♭"}
-};
-
-int init_parse(std::string* input);
-int note_parse(std::string* input);
-
-void display_part(init_params p);
-void display_note(note nt);
-void display_chord(chord notes);
-void display_measure(measure msur);
-
-uint16_t nearest_bin_power(uint16_t n) {
-    n--;
-    n |= n >> 1;
-    n |= n >> 2;
-    n |= n >> 4;
-    n |= n >> 8;
-    n |= n >> 16;
-    n = (++n) >> 1;
-
-    return n;
-}
-
-int init_parse(std::string* input) {
-    init_state state = TAG;
-    init_params params;
-    
-    // Defaults
-    params.beats = 4;
-    params.beat_type = 4;
-    params.key_center = 'C';
-    params.major = 0;
-
-    char* input_str = (char*) input->c_str();
-    std::string tag_str;
-    std::string value_str;
-
-    bool tag_active = false;
-    bool value_active = false;
-    char c;
-    while ((c = *input_str++) != '\0') {
-        if (tag_active) tag_str.append(1, c);
-        if (value_active) value_str.append(1, c);
-
-        if (c == '<') {
-            switch (state) {
-                case BEATS:
-                    params.beats = (uint16_t) std::stoi(value_str);
-                    break;
-                case BEAT_TYPE:
-                    params.beat_type = (uint16_t) std::stoi(value_str);
-                    break;
-                case DIVISIONS:
-                    params.division_count = (uint8_t) std::stoi(value_str);
-                    break;
-                case KEY_T:
-                    params.key_center = (int8_t) std::stoi(value_str);
-                    break;
-                case KEY_M:
-                    params.major = (value_str.compare("major") == 0);
-                    break;
-                default:
-                    break;
-            }
+// The file named by hash h in the cache under dir, in a bucket named by its first two digits.
+std::string entry_path(const char* dir, const uint64_t h[2], const char* ext) {
+    char name[40];
+    snprintf(name, sizeof(name), "%016llx%016llx", (unsigned long long) h[0], (unsigned long long) h[1]);
+    return std::string(dir) + "/" + std::string(name, 2) + "/" + (name + 2) + ext;
+}
 
-            state = TAG;
-            tag_active = true;
+/**
+ * Where the conversion of input with opts lives in the cache under dir: the file is named by a hash of the input
+ * bytes, the parser version and every render option that changes the text.
+ */
+std::string cache_entry(const char* dir, const input_buffer* input, const render_options* opts) {
+    std::string salt = render_salt(opts);
+    uint64_t seed[2];
+    uint64_t h[2];
+    hash_bytes(salt.data(), salt.size(), 0, seed);
+    hash_bytes(input->data, input->size, seed[0] ^ seed[1], h);
+    return entry_path(dir, h, ".txt");
+}
 
-            value_str.clear();
-            value_active = false;
-        }
+/**
+ * Copies a cached conversion to out. Returns false on a miss.
+ */
+bool cache_fetch(const std::string& entry, FILE* out) {
+    int fd = open(entry.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    std::string text;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+        text.resize((size_t) st.st_size);
+        ok = read(fd, &text[0], text.size()) == (ssize_t) text.size();
+    }
+    close(fd);
+    return ok && fwrite(text.data(), 1, text.size(), out) == text.size();
+}
 
-        if (c == '>') {
-            tag_str.erase(std::remove_if(tag_str.begin(), tag_str.end(), isspace), tag_str.end());
-            tag_str.pop_back();
-
-            if (tag_str.compare(S_DIVISIONS) == 0) {
-                state = DIVISIONS;
-                value_active = true;
-            } else if (tag_str.compare(S_FIFTHS) == 0) {
-                state = KEY_T;
-                value_active = true;
-            } else if (tag_str.compare(S_MODE) == 0) {
-                state = KEY_M;
-                value_active = true;
-            } else if (tag_str.compare(S_BEATS) == 0) {
-                state = BEATS;
-                value_active = true;
-            } else if (tag_str.compare(S_BEAT_TYPE) == 0) {
-                state = BEAT_TYPE;
-                value_active = true;
-            } else if (tag_str.compare(S_CLOSE_ATTR) == 0) {
-                part_params.push_back(params);
-            }
+/**
+ * Stores text under entry. It is written to a private temporary first, so concurrent writers and readers of the
+ * same entry only ever see a whole file.
+ */
+void cache_store(const std::string& entry, const std::string& text) {
+    std::string bucket = entry.substr(0, entry.rfind('/'));
+    mkdir(bucket.substr(0, bucket.rfind('/')).c_str(), 0777);
+    mkdir(bucket.c_str(), 0777);
+
+    std::string tmp = entry + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) return;
+
+    bool ok = write(fd, text.data(), text.size()) == (ssize_t) text.size();
+    ok &= close(fd) == 0;
+    if (!ok || rename(tmp.c_str(), entry.c_str()) != 0) unlink(tmp.c_str());
+}
+
+/**
+ * Where the index of the file at path lives in the cache under dir. It is named by a hash of the file's
+ * identity, size and modification time, so finding it costs a stat rather than a read of the whole file.
+ * Empty for stdin or a file that cannot be stat'ed.
+ */
+std::string index_entry(const char* dir, const char* path) {
+    struct stat st;
+    if (strcmp(path, "-") == 0 || stat(path, &st) != 0) return "";
+
+    char key[160];
+    snprintf(key, sizeof(key), "%s\n%llu %llu %llu %lld.%09ld", MP_PARSER_VERSION, (unsigned long long) st.st_dev,
+             (unsigned long long) st.st_ino, (unsigned long long) st.st_size, (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    uint64_t h[2];
+    hash_bytes(key, strlen(key), 0, h);
+    return entry_path(dir, h, ".idx");
+}
+
+/**
+ * Where the conversion print of the file at path with opts lives in the cache under dir. It is named by the
+ * file's real path rather than its contents, so an edited file finds the print of its last conversion. Empty
+ * for stdin or a path that cannot be resolved.
+ */
+std::string print_entry(const char* dir, const char* path, const render_options* opts) {
+    if (strcmp(path, "-") == 0) return "";
+    char* real = realpath(path, NULL);
+    if (!real) return "";
+    std::string key = render_salt(opts) + "\n" + real;
+    free(real);
+
+    uint64_t h[2];
+    hash_bytes(key.data(), key.size(), 0, h);
+    return entry_path(dir, h, ".prt");
+}
 
-            tag_str.clear();
-            tag_active = false;
+/**
+ * Points ctx->index at an index of input when ctx->select leaves something out and there is a cache to keep
+ * indexes in. A cached index is used if there is one; otherwise one is built now and added to the cache.
+ */
+void attach_index(parse_context* ctx, const char* path, const input_buffer* input, const char* cache_dir, file_index* index) {
+    ctx->index = NULL;
+    if (!cache_dir || selects_all(&ctx->select)) return;
+    std::string entry = index_entry(cache_dir, path);
+    if (entry.empty()) return;
+
+    input_buffer cached;
+    bool loaded = open_input(entry.c_str(), &cached) == 0;
+    if (loaded) {
+        loaded = load_index(cached.data, cached.size, index) == 0 && index->input_size == input->size;
+        close_input(&cached);
+    }
+    if (!loaded) {
+        build_index(input, index);
+        char* data = NULL;
+        size_t size = 0;
+        FILE* mem = open_memstream(&data, &size);
+        if (mem) {
+            bool ok = save_index(index, mem) == 0;
+            ok &= fclose(mem) == 0;
+            if (ok) cache_store(entry, std::string(data, size));
+            free(data);
         }
     }
+    ctx->index = index;
+}
 
+/**
+ * Converts input, read from path, into text for the conversion cache under cache_dir. The print of the file's
+ * last conversion is kept there as well, so that after an edit only the measures that changed are converted.
+ */
+int convert_cached(parse_context* ctx, const char* path, const input_buffer* input, const render_options* opts,
+                   const char* cache_dir, std::string* text) {
+    std::string entry = print_entry(cache_dir, path, opts);
+    if (entry.empty()) {
+        const score* piece = parse_score(ctx, input->data, input->size);
+        return piece ? render(piece, opts, text) : 1;
+    }
+
+    conversion_print print;
+    print.frame = 0;
+    input_buffer cached;
+    if (open_input(entry.c_str(), &cached) == 0) {
+        if (load_print(cached.data, cached.size, &print) != 0) print.measures.clear();
+        close_input(&cached);
+    }
+    if (reconvert(ctx, input, opts, &print) != 0) return 1;
+
+    char* data = NULL;
+    size_t size = 0;
+    FILE* mem = open_memstream(&data, &size);
+    if (mem) {
+        bool ok = save_print(&print, mem) == 0;
+        ok &= fclose(mem) == 0;
+        if (ok) cache_store(entry, std::string(data, size));
+        free(data);
+    }
+    text->swap(print.text);
     return 0;
 }
 
-int note_parse(std::string* input) {
-    note_state state = PART;
-
-    char* input_str = (char*) input->c_str();
-    std::string tag_str;
-    std::string value_str;
-
-    measure measure_obj;
-    measure_obj.measure_num = 0;
-
-    chord notes;
-    notes.duration = 0;
-    notes.part = 0;
-
-    note note_obj;
-    note_obj.alter = INT8_MIN;
-    note_obj.part = 0;
-    note_obj.octave = 0;
-
-    uint16_t div_count = 0;
-
-    bool tag_active = false;
-    bool value_active = false;
-    char c;
-    while ((c = *input_str++) != '\0') {
-        if (c == '<') {
-            switch (state) {
-                case PART:
-                case PART_ID:
-                case MEASURE:
-                case MEASURE_NUM:
-                case NOTE:
-                case PITCH:
-                    tag_active = true;
-                    continue;
-                case DURATION:
-                    note_obj.duration = (uint8_t) std::stoi(value_str);
-                    state = PITCH;
-                    break;
-                case ALTER:
-                    note_obj.alter = (int8_t) std::stoi(value_str);
-                    state = PITCH;
-                    break;
-                case OCTAVE:
-                    note_obj.octave = (uint8_t) std::stoi(value_str);
-                    state = PITCH;
-                    break;
-                case STEP:
-                    note_obj.pitch = value_str.c_str()[0];
-                    state = PITCH;
-                    break;
-                case VOICE:
-                    note_obj.voice = (uint8_t) std::stoi(value_str);
-                    state = PITCH;
-                    break;
+/**
+ * Converts the file at path (or stdin for "-") with ctx and writes it to out, measure by measure if stream
+ * is set. With a cache_dir, a conversion already in the cache is copied out without parsing, and a new one
+ * is added to it, converting only what changed since the file's last conversion. When ctx->select leaves
+ * parts or measures out, no conversion is cached: the cache keeps only the file's index, since hashing the
+ * whole file would cost more than the parse it saves. A score file is rendered straight from its mapping.
+ * Returns nonzero if the file could not be read or holds no parts.
+ */
+int convert(parse_context* ctx, const char* path, const render_options* opts, bool stream, const char* cache_dir, FILE* out) {
+    input_buffer input;
+    int opened;
+    {
+        STAT_TIMER(timer, &ctx->stats.read_ns);
+        opened = open_input(path, &input);
+    }
+    if (opened != 0) return 1;
+
+    int failed;
+    if (is_score_file(input.data, input.size)) {
+        score_view view;
+        failed = load_score(input.data, input.size, &view) == 0 ? display_view(&view, opts, out) : 1;
+    } else if (cache_dir && selects_all(&ctx->select)) {
+        std::string entry = cache_entry(cache_dir, &input, opts);
+        if (cache_fetch(entry, out)) {
+            STAT_ADD(&ctx->stats, cache_hits, 1);
+            failed = 0;
+        } else {
+            std::string text;
+            failed = convert_cached(ctx, path, &input, opts, cache_dir, &text);
+            if (!failed && opts->tokens) text.insert(0, npy_header(text.size()));
+            if (!failed) {
+                failed = fwrite(text.data(), 1, text.size(), out) != text.size();
+                cache_store(entry, text);
             }
-
-            value_str.clear();
-            value_active = false;
         }
-
-        if (tag_str.compare(S_MEASURE) == 0 && state == MEASURE) {
-            state = MEASURE_NUM;
-            tag_str.clear();
+    } else {
+        file_index index;
+        attach_index(ctx, path, &input, cache_dir, &index);
+        if (stream && !opts->tokens) { // A .npy file needs its length before the tokens.
+            failed = parse_stream(ctx, &input, opts, out);
+        } else {
+            const score* piece = parse_score(ctx, input.data, input.size);
+            failed = piece ? display(piece, opts, out) : 1;
         }
+        ctx->index = NULL;
+    }
 
-        if (tag_str.compare(S_PART) == 0 && isspace(c)) {
-            state = PART_ID;
-            tag_str.clear();
-        }
+    close_input(&input);
+    return failed;
+}
 
-        if (c == '=') {
-            tag_str.erase(std::remove_if(tag_str.begin(), tag_str.end(), isspace), tag_str.end());
-            if ((state == MEASURE_NUM && tag_str.compare(S_NUMBER) == 0) || (state == PART_ID && tag_str.compare(S_ID) == 0)) {
-                tag_str.clear();
-                tag_active = false;
-
-                // Hacking to find the value inside the quotes.
-                while (c == '"' || isspace(c = *input_str++));
-                while ((c = *input_str++) != '"') value_str.append(1, c);
-                if (state == MEASURE_NUM) {
-                    measure_obj.measure_num = (uint32_t) std::stoi(value_str);
-                } else if (state == PART_ID) {
-                    if (value_str.size() >= 2) value_str = value_str.substr(1, value_str.size() - 1);
-                    note_obj.part = (uint8_t) std::stoi(value_str) - 1;
-                    state = MEASURE;
-                }
-                value_str.clear();
+/**
+ * Writes the token vocabulary to path, one name per line, so that line i names token i.
+ */
+int write_vocab(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) return 1;
+    for (uint16_t id = 0; id < TOK_COUNT; id++) fprintf(out, "%s\n", token_name(id).c_str());
+    return fclose(out) != 0;
+}
 
-                while ((c = *input_str++) != '>');
-            }
-        }
+/**
+ * Parses and merges the MusicXML file at path and writes the score to out as a score file.
+ */
+int compile(parse_context* ctx, const char* path, FILE* out) {
+    input_buffer input;
+    int opened;
+    {
+        STAT_TIMER(timer, &ctx->stats.read_ns);
+        opened = open_input(path, &input);
+    }
+    if (opened != 0) return 1;
 
-        if (c == '>') {
-            tag_str.erase(std::remove_if(tag_str.begin(), tag_str.end(), isspace), tag_str.end());
+    const score* piece = parse_score(ctx, input.data, input.size);
+    int failed = piece ? save_score(piece, out) : 1;
+    close_input(&input);
+    return failed;
+}
 
-            if (tag_str.find(S_NOTE) != std::string::npos) {
-                if (tag_str.compare(S_CLOSE_NOTE) == 0) {
-                    // Add note object to the note group
-                    div_count += note_obj.duration;
+/**
+ * Writes the file at path (or stdin for "-"), converted with --repeats, to out with every reference replaced by
+ * the measure it names. A .npy file of tokens is written as one again.
+ */
+int expand(const char* path, FILE* out) {
+    input_buffer input;
+    if (open_input(path, &input) != 0) return 1;
+
+    const char* data = input.data;
+    size_t size = input.size;
+    bool tokens = size >= 10 && memcmp(data, "\x93NUMPY", 6) == 0;
+    if (tokens) {
+        size_t header = std::min(size, 10 + ((size_t) (uint8_t) data[8] | (size_t) (uint8_t) data[9] << 8));
+        data += header;
+        size -= header;
+    }
 
-                    notes.part = note_obj.part;
-                    notes.voices.push_back(note_obj);
+    std::string text;
+    int failed = expand_repeats(data, size, tokens, &text);
+    if (failed) fprintf(stderr, "musicparse: %s refers to a measure it does not hold\n", path);
+    if (!failed && tokens) text.insert(0, npy_header(text.size()));
+    if (!failed) failed = fwrite(text.data(), 1, text.size(), out) != text.size();
+    close_input(&input);
+    return failed;
+}
 
-                    if (div_count >= part_params[note_obj.part].division_count) {
-                        notes.duration = div_count;
-                        measure_obj.beat_content.push_back(notes);
-                        notes.voices.clear();
-                        div_count %= part_params[note_obj.part].division_count;
-                    }
+typedef struct __batchjob__ {
+    std::string input;
+    std::string output;
+    std::string key; // Replaces the K: line when not empty.
+} batch_job;
+
+// One deque per worker. The owner takes from the back and thieves take from the front.
+typedef struct __workqueue__ {
+    std::mutex lock;
+    std::deque<size_t> tasks;
+} work_queue;
+
+typedef struct __batchoptions__ {
+    const char* source; // A directory of .xml files or a file listing one path per line.
+    const char* out_dir; // NULL writes each output next to its input.
+    bool chorales; // Lay outputs out as <out>/<key>_<maj|min>/<NUM>.txt like batch_musicparse.sh.
+    bool ml_flag;
+    bool stream; // Write each measure as soon as it is complete.
+    bool stats; // Report the batch's totals as JSON on stderr.
+    bool stats_per_file; // And a line for each file.
+    const char* cache_dir; // Conversion cache, or NULL.
+    bool emit_score; // Write score files (.mps) instead of text.
+    bool tokens; // Write token IDs (.npy) instead of text.
+    unsigned shards; // 0, or append every output to this many shard files in out_dir instead.
+    unsigned transpose_keys; // 0, or write every input in 12 or 15 keys to <out>/<key>_<maj|min>/.
+    unsigned jobs;
+    unsigned merge_threads; // Threads each file's merge may use. 0 shares out the cores the workers leave idle.
+    selection select; // The parts and measures converted.
+    uint32_t repeats; // render_options.repeats.
+} batch_options;
 
-                    // Reset note_obj.
-                    note_obj.alter = INT8_MIN;
-                }
-                state = NOTE;
-            } else if (tag_str.compare(S_PITCH) == 0) {
-                state = PITCH;
-            } else if (state == PITCH && tag_str.compare(S_DURATION) == 0) {
-                value_active = true;
-                state = DURATION;
-            } else if (state == PITCH && tag_str.compare(S_OCTAVE) == 0) {
-                value_active = true;
-                state = OCTAVE;
-            } else if (state == PITCH && tag_str.compare(S_STEP) == 0) {
-                value_active = true;
-                state = STEP;
-            } else if (state == PITCH && tag_str.compare(S_ALTER) == 0) {
-                value_active = true;
-                state = ALTER;
-            } else if (tag_str.compare(S_VOICE) == 0) {
-                value_active = true;
-                state = VOICE;
-            } else if (tag_str.find(S_REST) != std::string::npos) {
-                state = PITCH;
-                note_obj.pitch = 'R';
-                note_obj.octave = 0;
-            } else if (tag_str.compare(S_CLOSE_MEASURE) == 0) {
-                // Add the measure to the measure list.
-                std::deque<measure>::iterator iter = measure_list.begin();
-                for (; iter < measure_list.end(); iter++) {
-                    if (iter->measure_num == measure_obj.measure_num) {
-                        break;
-                    }
-                }
-                measure_list.insert(iter, measure_obj);
-
-                notes.voices.clear();
-                measure_obj.beat_content.clear();
-                state = MEASURE;
-            } else if (tag_str.compare(S_CLOSE_PART) == 0) {
-                state = PART;
-                div_count = 0;
-                measure_obj.measure_num = 0;
-                note_obj.alter = INT8_MIN;
-            }
+/**
+ * Reads a --parts list such as "1,4" (parts count from 1, in document order) into sel. Returns false if
+ * list is not one.
+ */
+bool parse_parts(const char* list, selection* sel) {
+    sel->parts.clear();
+    for (const char* p = list; *p;) {
+        char* end;
+        long part = strtol(p, &end, 10);
+        if (end == p || part < 1 || part > 4096 || (*end && *end != ',')) return false;
+        if (sel->parts.size() < (size_t) part) sel->parts.resize((size_t) part, false);
+        sel->parts[part - 1] = true;
+        p = *end ? end + 1 : end;
+    }
+    return !sel->parts.empty();
+}
 
-            tag_str.clear();
-            tag_active = false;
-            continue;
+/**
+ * Reads a --measures range into sel: "9-16", "9-" (to the end) or "9" alone. Returns false if range is not one.
+ */
+bool parse_measures(const char* range, selection* sel) {
+    char* end;
+    long first = strtol(range, &end, 10);
+    if (end == range || first < 0) return false;
+    long last = first;
+    if (*end == '-') {
+        const char* p = end + 1;
+        if (*p) {
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return false;
+        } else {
+            last = (long) UINT32_MAX;
+            end = (char*) p;
         }
-
-        if (tag_active) tag_str.append(1, c);
-        if (value_active) value_str.append(1, c);
     }
-    return 0;
+    if (*end) return false;
+    sel->first_measure = (uint32_t) first;
+    sel->last_measure = (uint32_t) last;
+    return true;
 }
 
-void display_part(init_params p) {
-    printf("M: %d/%d\nK: %s\n", p.beats, p.beat_type, (p.major == 0 ? major_map[p.key_center].c_str() : minor_map[p.key_center].c_str()));
-}
+const unsigned MAX_THREADS = 1024; // The most --jobs and --threads take.
+const unsigned MAX_SHARDS = 1000; // Shard files are numbered with three digits.
 
-int display() {
-    // Displaying the initial parameters.
-    display_part(part_params[0]);
+/**
+ * Reads a count such as --jobs 8 into *count. Returns false unless arg is a whole number from 1 to max.
+ */
+bool parse_count(const char* arg, unsigned max, unsigned* count) {
+    char* end;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (end == arg || *end || *arg < '0' || *arg > '9' || n < 1 || n > max) return false;
+    *count = (unsigned) n;
+    return true;
+}
 
-    // Displaying the measures themselves
-    for (auto measure : measure_list) {
-        display_measure(measure);
+/**
+ * Reads how far back --repeats reaches: a number of measures, or "all". Returns false if arg is neither.
+ */
+bool parse_repeats(const char* arg, uint32_t* repeats) {
+    if (strcmp(arg, "all") == 0) {
+        *repeats = REPEAT_ALL;
+        return true;
     }
+    char* end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || *end || *arg < '0' || *arg > '9') return false;
+    *repeats = n >= REPEAT_ALL ? REPEAT_ALL : (uint32_t) n;
+    return true;
+}
 
-    return 0;
+bool ends_with(const std::string& s, const char* suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
 }
 
-void display_note(note nt) {
-    if (!ml_flag) { // Display nicely.
-        if (nt.alter == INT8_MIN) {
-            printf("%c%d", nt.pitch, nt.octave);
-        } else {
-            printf("%c%s%d", nt.pitch, accidental_map[nt.alter].c_str(), nt.octave);
+std::string dir_name(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+std::string base_name(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+/**
+ * Collects the inputs named by source, sorted so that collisions resolve the same way on every run.
+ */
+int list_inputs(const char* source, std::vector<std::string>& inputs) {
+    struct stat st;
+    if (stat(source, &st) != 0) return 1;
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(source);
+        if (!dir) return 1;
+        for (struct dirent* ent = readdir(dir); ent; ent = readdir(dir)) {
+            std::string name = ent->d_name;
+            if (ends_with(name, ".xml") || ends_with(name, ".mxl") || ends_with(name, ".mps")) inputs.push_back(std::string(source) + "/" + name);
         }
-    } else { // Tokenization form.
-        if (nt.pitch == 'R') {
-            printf("");
-            return;
+        closedir(dir);
+    } else {
+        FILE* list = fopen(source, "r");
+        if (!list) return 1;
+        char line[4096];
+        while (fgets(line, sizeof(line), list)) {
+            size_t len = strcspn(line, "\r\n");
+            if (len) inputs.push_back(std::string(line, len));
         }
+        fclose(list);
+    }
+
+    std::sort(inputs.begin(), inputs.end());
+    return 0;
+}
 
-        if (nt.alter == INT8_MIN) {
-            printf("%c", nt.pitch);
+/**
+ * Works out where a chorale goes the same way batch_musicparse.sh does: the key comes from the letters at the
+ * end of the file name (lower case for minor) and the number from the directory name read as hex. Returns
+ * false for files the script would skip.
+ */
+bool chorale_job(const std::string& path, const std::string& out_dir, batch_job* job) {
+    std::string name = base_name(path);
+    if (name.compare(0, 7, "Chorale") != 0) return false;
+
+    // The last six characters without digits, up to the extension: "12Af.xml" -> "Af".
+    std::string letters;
+    for (size_t i = name.size() > 6 ? name.size() - 6 : 0; i < name.size(); i++) {
+        if (name[i] < '0' || name[i] > '9') letters += name[i];
+    }
+    letters = letters.substr(0, letters.rfind('.'));
+    if (letters.empty() || letters.size() > 2) return false;
+
+    bool minor = islower((unsigned char) letters[0]);
+    char tonic = (char) tolower((unsigned char) letters[0]);
+    if (tonic < 'a' || tonic > 'g') return false;
+
+    const char* folder_acc = "";
+    const char* written_acc = "";
+    if (letters.size() == 2) {
+        char acc = (char) tolower((unsigned char) letters[1]);
+        if (acc == 'f') {
+            folder_acc = "_flat";
+            written_acc = "♭";
+        } else if (acc == 's') {
+            folder_acc = "_sharp";
+            written_acc = "#";
         } else {
-            printf("%c%s", nt.pitch, accidental_map[nt.alter].c_str());
+            return false;
         }
     }
-}
 
-void display_chord(chord notes) {
-    uint8_t subdiv_count = 0;
-    for (std::deque<note>::iterator iter = notes.voices.begin(); iter < notes.voices.end(); iter++) {
-        uint8_t duration = iter->duration;
-        uint8_t part_div_c = part_params[iter->part].division_count;
-        if (duration < notes.duration) {
-            std::deque<note>::iterator start_pos = iter;
+    // The script only knows these spellings.
+    static const char* known[] = {"af", "a", "as", "bf", "b", "cf", "c", "cs", "df", "d", "ef", "e", "f", "fs", "gf", "g", "gs"};
+    std::string lowered = std::string(1, tonic) + (letters.size() == 2 ? std::string(1, (char) tolower((unsigned char) letters[1])) : "");
+    if (std::find(known, known + sizeof(known) / sizeof(known[0]), lowered) == known + sizeof(known) / sizeof(known[0])) return false;
 
-            uint16_t max_sub_dur = 0;
-            while (iter < notes.voices.end() && (subdiv_count += iter->duration) < notes.duration) {
-                max_sub_dur = (iter->duration >= max_sub_dur) ? iter->duration : max_sub_dur;
-                iter++;
-            }
+    char num[16];
+    snprintf(num, sizeof(num), "%03lX", strtoul(base_name(dir_name(path)).c_str(), NULL, 16));
 
-            chord temp;
-            temp.voices.assign(start_pos, iter + 1);
-            temp.duration = notes.duration / 2;
-
-            if (iter != notes.voices.end()) {
-                if (duration < part_div_c) printf("(");
-                display_chord(temp);
-                if (duration < part_div_c) printf(")");
-                if ((iter + 1) != notes.voices.end()
-                    && duration <= (iter + 1)->duration
-                    && (iter + 1)->duration < part_div_c / 2) printf(",");
-            }
-
-            subdiv_count = 0;
-        } else {
-            display_note(*iter);
-            if (iter->duration == notes.duration && iter->duration < part_div_c && iter != notes.voices.end() - 1) printf(",");
-        }
-    }
+    job->input = path;
+    job->output = out_dir + "/" + tonic + folder_acc + (minor ? "_min/" : "_maj/") + num + ".txt";
+    job->key = std::string(1, minor ? tonic : (char) toupper((unsigned char) tonic)) + written_acc;
+    return true;
 }
 
-void display_measure(measure m) {
-    printf("M%d: ", m.measure_num);
-    for (auto crd : m.beat_content) {
-        printf("[");
-        display_chord(crd);
-        printf("]");
-
-        if (crd.duration > part_params[crd.part].division_count) printf("%d", crd.duration / part_params[crd.part].division_count);
-        printf(" ");
+/**
+ * Makes every directory leading up to path.
+ */
+void make_parents(const std::string& path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        mkdir(path.substr(0, slash).c_str(), 0777);
     }
-    printf("|\n");
 }
 
-void handle_dots(measure& m) {
-    uint8_t div_count = 0;
-    for (std::deque<chord>::iterator beat = m.beat_content.begin(); beat < m.beat_content.end(); beat++) {
-        for (std::deque<note>::iterator iter = beat->voices.begin(); iter < beat->voices.end(); iter++) {
-            if ((iter->duration + div_count) > part_params[beat->part].division_count && (iter->duration + div_count) % part_params[beat->part].division_count != 0) {
-                note copy_note = {iter->octave,
-                                  (uint8_t) (iter->duration + div_count - part_params[beat->part].division_count),
-                                  iter->part,
-                                  iter->voice,
-                                  iter->alter,
-                                  iter->pitch};
-
-                iter->duration = part_params[beat->part].division_count - div_count;
-                beat->duration = part_params[beat->part].division_count;
-                if (copy_note.duration >= part_params[beat->part].division_count) {
-                    chord temp;
-                    temp.voices.push_back(copy_note);
-                    temp.duration = copy_note.duration;
-                    m.beat_content.insert(beat + 1, temp);
-                } else {
-                    std::deque<chord>::iterator next = std::next(beat, 1);
-                    if (next != m.beat_content.end()) {
-                        next->voices.push_front(copy_note);
-                    } else {
-                        beat->voices.push_front(copy_note);
-                    }
-                }
-            } else if ((iter->duration + div_count) < part_params[beat->part].division_count && (iter->duration + div_count) % 2 == 1) {
-                note copy_note = *iter;
+/**
+ * A worker's handle on the shards of a batch. Records are spread over count shards by a hash of their id, and
+ * each worker opens its own descriptors, so flock keeps threads and processes from interleaving records.
+ */
+typedef struct __shardwriter__ {
+    std::string dir;
+    unsigned count;
+    std::vector<int> data_fds; // -1 until first used.
+    std::vector<int> index_fds;
+} shard_writer;
+
+// One output on its way out: a temporary file renamed into place, or a memory stream bound for a shard.
+typedef struct __output__ {
+    std::string path;
+    std::string tmp;
+    FILE* file;
+    char* buffer; // What the memory stream held, once it is closed.
+    size_t size;
+} output;
+
+std::string shard_path(const std::string& dir, unsigned shard, const char* ext) {
+    char name[32];
+    snprintf(name, sizeof(name), "/shard-%03u.%s", shard, ext);
+    return dir + name;
+}
 
-                uint16_t n = nearest_bin_power(iter->duration);
-                copy_note.duration = iter->duration - n;
+void init_shards(shard_writer* shards, const char* dir, unsigned count) {
+    shards->dir = dir;
+    shards->count = count;
+    shards->data_fds.assign(count, -1);
+    shards->index_fds.assign(count, -1);
+}
 
-                if (n != 0) {
-                    iter->duration = n;
-                    beat->voices.insert(iter + 1, copy_note);
-                }
-            }
+void close_shards(shard_writer* shards) {
+    for (int fd : shards->data_fds) if (fd >= 0) close(fd);
+    for (int fd : shards->index_fds) if (fd >= 0) close(fd);
+}
 
-            div_count += iter->duration;
-            if (div_count >= part_params[beat->part].division_count) div_count %= part_params[beat->part].division_count;
-        }
+/**
+ * Appends a record to its shard, 8 byte aligned (so a score file in it can be mapped in place), and then its
+ * line to the shard's index: id, offset, length, key and meter, separated by tabs. Both happen under an
+ * exclusive flock on the shard, so an index line never points at a record that is not all there.
+ */
+int shard_append(shard_writer* shards, const std::string& id, const char* data, size_t size, const init_params& p, const char* key) {
+    uint64_t h[2];
+    hash_bytes(id.data(), id.size(), 0, h);
+    unsigned s = (unsigned) (h[0] % shards->count);
+    if (shards->data_fds[s] < 0) {
+        shards->data_fds[s] = open(shard_path(shards->dir, s, "bin").c_str(), O_RDWR | O_CREAT | O_APPEND, 0666);
+        shards->index_fds[s] = open(shard_path(shards->dir, s, "idx").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (shards->data_fds[s] < 0 || shards->index_fds[s] < 0) return 1;
     }
+    int fd = shards->data_fds[s];
+    if (flock(fd, LOCK_EX) != 0) return 1;
+
+    static const char padding[8] = {0};
+    off_t end = lseek(fd, 0, SEEK_END);
+    size_t pad = (size_t) ((8 - end % 8) % 8);
+    bool ok = end >= 0 && write(fd, padding, pad) == (ssize_t) pad;
+    ok = ok && write(fd, data, size) == (ssize_t) size;
+
+    char fields[128];
+    snprintf(fields, sizeof(fields), "\t%lld\t%zu\t%s\t%u/%u\n", (long long) (end + pad), size, key, p.beats, p.beat_type);
+    std::string line = id + fields;
+    ok = ok && write(shards->index_fds[s], line.data(), line.size()) == (ssize_t) line.size();
+
+    flock(fd, LOCK_UN);
+    return ok ? 0 : 1;
 }
 
-int compare_notes(const note& n1, const note& n2) {
-    if (n1.octave < n2.octave) {
-        return -1;
-    } else if (n1.octave > n2.octave) {
-        return 1;
+/**
+ * Opens the output for path: straight into the shards when there are any, otherwise a temporary file next to
+ * path, so a reader never sees half an output.
+ */
+int open_output(const shard_writer* shards, const std::string& path, output* out) {
+    out->path = path;
+    out->buffer = NULL;
+    out->size = 0;
+    if (shards) {
+        out->file = open_memstream(&out->buffer, &out->size);
     } else {
-        uint8_t p2 = n2.pitch < 'C' ? n2.pitch + 10 : n2.pitch;
-        if (n1.pitch < p2) {
-            return -1;
-        }
-        return (n1.pitch > p2);
+        out->tmp = path + ".tmp";
+        out->file = fopen(out->tmp.c_str(), "w");
     }
+    return out->file ? 0 : 1;
 }
 
-void merge_beat_lists(std::deque<chord>& concat_beat_content, std::deque<chord> partn) {
-    if (concat_beat_content.size() == 0) {
-        concat_beat_content.insert(concat_beat_content.end(), partn.begin(), partn.end());
-        return;
+/**
+ * Finishes an output: renames the temporary file into place, or appends the record to the shards under
+ * path's name relative to the shard directory, without its extension. p and key describe it in the index.
+ */
+int close_output(shard_writer* shards, output* out, int failed, const init_params& p, const char* key) {
+    failed |= fclose(out->file) != 0;
+    if (shards) {
+        std::string id = out->path;
+        if (id.compare(0, shards->dir.size() + 1, shards->dir + "/") == 0) id.erase(0, shards->dir.size() + 1);
+        id = id.substr(0, id.rfind('.'));
+        if (!failed) failed = shard_append(shards, id, out->buffer, out->size, p, key);
+        free(out->buffer);
+        return failed;
     }
 
-    // Begin merging sequentially.
-    for (uint8_t i = 0, j = 0; i < concat_beat_content.size() && j < partn.size(); ) {
-        if (concat_beat_content[i].duration == partn[j].duration) {
-            if (compare_notes(concat_beat_content[i].voices[0], partn[j].voices[0]) < 0) {
-                concat_beat_content[i].voices.insert(concat_beat_content[i].voices.end(), partn[j].voices.begin(), partn[j].voices.end());
-            } else {
-                concat_beat_content[i].voices.insert(concat_beat_content[i].voices.begin(), partn[j].voices.begin(), partn[j].voices.end());
-            }
+    if (!failed) failed = rename(out->tmp.c_str(), out->path.c_str()) != 0;
+    if (failed) unlink(out->tmp.c_str());
+    return failed;
+}
 
-            i++;
-            j++;
-        } else if (concat_beat_content[i].duration > partn[j].duration) {
-            uint8_t div_count = 0;
-            while (j < partn.size() && (div_count += partn[j].duration) < concat_beat_content[i].duration) {
-                chord temp;
+/**
+ * Where the rendition of output in the key with key_center fifths goes: "out/017.txt" -> "out/b_flat_maj/017.txt".
+ */
+std::string key_path(const std::string& output, int8_t key_center, bool major) {
+    std::string folder;
+    for (const char* c = key_name(key_center, major); *c; c++) {
+        if (*c == '#') {
+            folder += "_sharp";
+        } else if ((unsigned char) *c >= 0x80) {
+            folder += "_flat"; // The only other character in a key name is the first byte of "♭".
+            break;
+        } else {
+            folder += (char) tolower((unsigned char) *c);
+        }
+    }
+    return dir_name(output) + "/" + folder + (major ? "_maj/" : "_min/") + base_name(output);
+}
 
-                for (auto& nt : concat_beat_content[i].voices) {
-                    nt.duration -= partn[j].duration;
-                    nt.part = 0;
-                }
-                concat_beat_content[i].duration -= partn[j].duration;
+/**
+ * Reads one job's input once (parsing it, or mapping a score file) and writes it out, in every key of its
+ * mode when transposing, reusing scratch for the transposed score. In the chorale layout, transposed files
+ * that already exist are kept.
+ */
+int render_job(parse_context* ctx, const batch_job& job, const batch_options* batch, score* scratch, shard_writer* shards) {
+    input_buffer input;
+    int opened;
+    {
+        STAT_TIMER(timer, &ctx->stats.read_ns);
+        opened = open_input(job.input.c_str(), &input);
+    }
+    if (opened != 0) return 1;
 
-                temp.voices.insert(temp.voices.end(), concat_beat_content[i].voices.begin(), concat_beat_content[i].voices.end());
-                temp.duration = partn[j].duration;
-                temp.part = 0;
+    score_view view;
+    int failed = 0;
+    if (is_score_file(input.data, input.size)) {
+        failed = load_score(input.data, input.size, &view);
+    } else {
+        file_index index;
+        attach_index(ctx, job.input.c_str(), &input, batch->cache_dir, &index);
+        const score* piece = parse_score(ctx, input.data, input.size);
+        ctx->index = NULL;
+        if (piece) view = view_score(piece);
+        failed = piece ? 0 : 1;
+    }
 
-                if (compare_notes(concat_beat_content[i].voices[0], partn[j].voices[0]) < 0) {
-                    temp.voices.insert(temp.voices.end(), partn[j].voices.begin(), partn[j].voices.end());
-                } else {
-                    temp.voices.insert(temp.voices.begin(), partn[j].voices.begin(), partn[j].voices.end());
-                }
+    render_options opts;
+    opts.ml_flag = batch->ml_flag;
+    opts.tokens = batch->tokens;
+    opts.key_override = batch->transpose_keys || job.key.empty() ? NULL : job.key.c_str();
+    opts.repeats = batch->repeats;
+    opts.stats = &ctx->stats;
+
+    int first = batch->transpose_keys == 12 ? -5 : -7;
+    int last = batch->transpose_keys == 12 ? 6 : 7;
+    if (!batch->transpose_keys) first = last = 0;
+    for (int k = first; k <= last && !failed; k++) {
+        score_view piece = view;
+        std::string path = job.output;
+        if (batch->transpose_keys) {
+            path = key_path(job.output, (int8_t) k, view.params[0].major);
+            struct stat st;
+            if (!shards && batch->chorales && stat(path.c_str(), &st) == 0) continue;
+
+            transpose_score(&view, (int8_t) k, scratch);
+            piece = view_score(scratch);
+        }
 
-                concat_beat_content.insert(concat_beat_content.begin() + i, temp);
+        if (!shards) make_parents(path);
+        output out;
+        if (open_output(shards, path, &out) != 0) {
+            failed = 1;
+            break;
+        }
 
-                j++;
-                i++;
-            }
+        if (batch->emit_score) {
+            failed = save_view(&piece, out.file);
         } else {
-            for (auto& nt : partn[j].voices) {
-                nt.duration -= concat_beat_content[i].duration;
-                nt.part = 0;
-            }
-
-            partn[j].duration -= concat_beat_content[i].duration;
-            partn[j].part = 0;
-
-            if (compare_notes(concat_beat_content[i].voices[0], partn[j].voices[0]) < 0) {
-                concat_beat_content[i].voices.insert(concat_beat_content[i].voices.end(), partn[j].voices.begin(), partn[j].voices.end());
-            } else {
-                concat_beat_content[i].voices.insert(concat_beat_content[i].voices.begin(), partn[j].voices.begin(), partn[j].voices.end());
-            }
-            i++;
+            failed = display_view(&piece, &opts, out.file);
+            if (!failed && batch->chorales && !batch->tokens) fputs("---\n", out.file);
         }
+        const char* key = opts.key_override ? opts.key_override : key_name(piece.params[0].key_center, piece.params[0].major);
+        failed = close_output(shards, &out, failed, piece.params[0], key);
     }
+
+    close_input(&input);
+    return failed;
 }
 
-void merge_beats(measure& m) {
-    std::vector<uint8_t> iter_locs;
-    std::deque<chord> concat_beat_content;
+/**
+ * Converts one job, or hands it to render_job when it is transposed or goes to shards.
+ */
+int run_job(parse_context* ctx, const batch_job& job, const batch_options* batch, score* scratch, shard_writer* shards) {
+    if (batch->transpose_keys || shards) return render_job(ctx, job, batch, scratch, shards);
+
+    output out;
+    if (open_output(NULL, job.output, &out) != 0) return 1;
+
+    render_options opts;
+    opts.ml_flag = batch->ml_flag;
+    opts.tokens = batch->tokens;
+    opts.key_override = job.key.empty() ? NULL : job.key.c_str();
+    opts.repeats = batch->repeats;
+    opts.stats = &ctx->stats;
+    int failed;
+    if (batch->emit_score) {
+        failed = compile(ctx, job.input.c_str(), out.file);
+    } else {
+        failed = convert(ctx, job.input.c_str(), &opts, batch->stream, batch->cache_dir, out.file);
+        if (!failed && batch->chorales && !batch->tokens) fputs("---\n", out.file);
+    }
+    return close_output(NULL, &out, failed, init_params(), "");
+}
 
-    // Getting all locations of overlap.
-    uint8_t part_num = part_params.size() - 1;
-    uint8_t voice_num = 1;
-    for (uint8_t i = 0; i < m.beat_content.size(); i++) {
-        if (m.beat_content[i].part == part_num) {
-            iter_locs.push_back(i);
-            part_num--;
-            voice_num++;
-        } else if (m.beat_content[i].voices[0].voice == voice_num) {
-            iter_locs.push_back(i);
-            voice_num++;
+bool take_job(std::vector<work_queue>& queues, size_t self, size_t* job) {
+    {
+        std::lock_guard<std::mutex> guard(queues[self].lock);
+        if (!queues[self].tasks.empty()) {
+            *job = queues[self].tasks.back();
+            queues[self].tasks.pop_back();
+            return true;
         }
     }
-    iter_locs.push_back(m.beat_content.size());
 
-    // Merging all beat lists together.
-    for (uint8_t i = 0; i < iter_locs.size() - 1; i++) {
-        std::deque<chord> temp(m.beat_content.begin() + iter_locs[i], m.beat_content.begin() + iter_locs[i + 1]);
-        merge_beat_lists(concat_beat_content, temp);
+    for (size_t k = 1; k < queues.size(); k++) {
+        work_queue& victim = queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            *job = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
     }
-    m.beat_content = concat_beat_content;
+    return false;
 }
 
-void merge_measures() {
-    // Insert into measures based on lexicographical ordering.
-    std::deque<measure> consolidated_list;
-    measure temp_measure;
-    temp_measure.measure_num = 0;
-
-    // Couple all like measures together.
-    for (auto& measure : measure_list) {
-        handle_dots(measure);
-        if (measure.measure_num != temp_measure.measure_num) {
-            if (!temp_measure.beat_content.empty()) {
-                consolidated_list.push_back(temp_measure);
-            }
-
-            temp_measure.measure_num = measure.measure_num;
-            temp_measure.beat_content.clear();
+void batch_worker(const std::vector<batch_job>* jobs, std::vector<work_queue>* queues, size_t self, const batch_options* opts,
+                  std::atomic<size_t>* failures, conv_stats* total) {
+    parse_context ctx;
+    init_context(&ctx);
+    ctx.merge_threads = opts->merge_threads;
+    ctx.select = opts->select;
+    score transposed;
+    shard_writer shards;
+    if (opts->shards) init_shards(&shards, opts->out_dir ? opts->out_dir : ".", opts->shards);
+
+    size_t j;
+    while (take_job(*queues, self, &j)) {
+        clear_stats(&ctx.stats);
+        if (run_job(&ctx, (*jobs)[j], opts, &transposed, opts->shards ? &shards : NULL) != 0) {
+            fprintf(stderr, "musicparse: could not convert %s\n", (*jobs)[j].input.c_str());
+            (*failures)++;
         }
-        temp_measure.beat_content.insert(temp_measure.beat_content.end(), measure.beat_content.begin(), measure.beat_content.end());
+
+        if (opts->stats_per_file) fprintf(stderr, "%s\n", stats_json(&ctx.stats, (*jobs)[j].input.c_str()).c_str());
+        add_stats(total, &ctx.stats);
     }
-    consolidated_list.push_back(temp_measure);
+    if (opts->shards) close_shards(&shards);
+}
 
-    // Standardizing durations
-    uint8_t max_duration = 0;
-    for (auto& param : part_params) {
-        max_duration = (param.division_count >= max_duration) ? param.division_count : max_duration;
+/**
+ * Converts every input named by opts->source on a pool of opts->jobs threads. Each thread owns its own
+ * parse_context, so nothing is shared but the job list.
+ */
+int run_batch(const batch_options* opts) {
+    std::vector<std::string> inputs;
+    if (list_inputs(opts->source, inputs) != 0) {
+        fprintf(stderr, "musicparse: cannot read %s\n", opts->source);
+        return 1;
     }
 
-    for (auto& measure : consolidated_list) {
-        for (auto& chord : measure.beat_content) {
-            uint8_t factor = max_duration / part_params[chord.part].division_count;
-            for (auto& nt : chord.voices) {
-                nt.duration *= factor;
+    if (opts->shards) make_parents(std::string(opts->out_dir ? opts->out_dir : ".") + "/");
+
+    std::vector<batch_job> jobs;
+    std::unordered_map<std::string, bool> claimed;
+    for (const auto& path : inputs) {
+        batch_job job;
+        if (opts->chorales) {
+            if (!chorale_job(path, opts->out_dir ? opts->out_dir : "outputs", &job)) continue;
+            // When transposing, one file per chorale and mode is enough: it is written in every key of its mode.
+            std::string claim = job.output;
+            if (opts->transpose_keys) {
+                std::string folder = base_name(dir_name(job.output));
+                job.output = dir_name(dir_name(job.output)) + "/" + base_name(job.output);
+                claim = job.output + folder.substr(folder.size() - 4); // "out/017.txt_min"
             }
-            chord.duration *= factor;
+            // Like the script, the first chorale to claim an output wins and existing outputs are kept.
+            struct stat st;
+            if (claimed.count(claim) || stat(job.output.c_str(), &st) == 0) continue;
+            claimed[claim] = true;
+        } else {
+            std::string stem = base_name(path);
+            stem = stem.substr(0, stem.rfind('.'));
+            job.input = path;
+            job.output = (opts->out_dir ? std::string(opts->out_dir) : dir_name(path)) + "/" + stem + ".txt";
         }
+        if (opts->emit_score) job.output.replace(job.output.size() - 4, 4, ".mps");
+        else if (opts->tokens) job.output.replace(job.output.size() - 4, 4, ".npy");
+        if (!opts->transpose_keys && !opts->shards) make_parents(job.output);
+        jobs.push_back(job);
     }
 
-    for (auto& param : part_params) {
-        param.division_count = max_duration;
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    size_t workers = opts->jobs ? opts->jobs : cores;
+    if (workers > jobs.size()) workers = jobs.size() ? jobs.size() : 1;
+
+    // With fewer files than cores, the spare cores go to merging the measures of each file.
+    batch_options worker_opts = *opts;
+    if (!worker_opts.merge_threads) worker_opts.merge_threads = std::max<unsigned>(1, cores / (unsigned) workers);
+    opts = &worker_opts;
+
+    std::vector<work_queue> queues(workers);
+    for (size_t j = 0; j < jobs.size(); j++) queues[j % workers].tasks.push_back(j);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::atomic<size_t> failures(0);
+    std::vector<conv_stats> totals(workers);
+    for (auto& total : totals) clear_stats(&total);
+
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < workers; w++) {
+        pool.push_back(std::thread(batch_worker, &jobs, &queues, w, opts, &failures, &totals[w]));
     }
+    batch_worker(&jobs, &queues, 0, opts, &failures, &totals[0]);
+    for (auto& t : pool) t.join();
 
-    // For each now concatenated measure, add together with respective beats.
-    for (auto& measure : consolidated_list) {
-        // Merge the beats together.
-        merge_beats(measure);
+    if (opts->stats) {
+        for (size_t w = 1; w < workers; w++) add_stats(&totals[0], &totals[w]);
+        double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "{\"workers\":%zu,\"wall_ms\":%.3f,\"total\":%s}\n", workers, wall_ms, stats_json(&totals[0], NULL).c_str());
     }
 
-    // Replacing our old list with our new one!
-    measure_list = consolidated_list;
+    return failures != 0;
 }
 
-int main(int argc, char** argv) {
-    if (argc < 2) return 1;
-    if (argc == 2 || atoi(argv[2]) == 0) ml_flag = false;
-
-    std::ifstream file(argv[1]);
-    std::string* fil_str = new std::string();
+// Whether arg is a batch option that takes a value.
+bool takes_value(const char* arg) {
+    static const char* const options[] = {"--batch", "--out", "--jobs", "--threads", "--parts", "--measures", "--repeats",
+                                          "--layout", "--cache", "--transpose", "--shards", "--vocab", "--emit"};
+    for (const char* option : options) {
+        if (strcmp(arg, option) == 0) return true;
+    }
+    return false;
+}
 
-    if (file.is_open()) {
-        std::string line;
-        while (std::getline(file, line)) {
-            fil_str->append(line.c_str());
+int main(int argc, char** argv) {
+    bool stream = false;
+    bool stats = false;
+    const char* cache_dir = NULL;
+    const char* score_path = NULL;
+    bool tokens = false;
+    bool vocab = false;
+    unsigned threads = 0;
+    uint32_t repeats = 0;
+    selection select;
+    select_all(&select);
+    for (;;) {
+        if (argc > 1 && strcmp(argv[1], "--stream") == 0) {
+            stream = true;
+        } else if (argc > 1 && strcmp(argv[1], "--stats") == 0) {
+            stats = true;
+        } else if (argc > 2 && strcmp(argv[1], "--cache") == 0) {
+            cache_dir = argv[2];
+            argc--;
+            argv++;
+        } else if (argc > 2 && strcmp(argv[1], "--emit-score") == 0) {
+            score_path = argv[2];
+            argc--;
+            argv++;
+        } else if (argc > 1 && strcmp(argv[1], "--tokens") == 0) {
+            tokens = true;
+        } else if (argc > 2 && strcmp(argv[1], "--threads") == 0) {
+            if (!parse_count(argv[2], MAX_THREADS, &threads)) {
+                fprintf(stderr, "musicparse: bad --threads %s\n", argv[2]);
+                return 1;
+            }
+            argc--;
+            argv++;
+        } else if (argc > 2 && strcmp(argv[1], "--parts") == 0) {
+            if (!parse_parts(argv[2], &select)) {
+                fprintf(stderr, "musicparse: bad --parts %s\n", argv[2]);
+                return 1;
+            }
+            argc--;
+            argv++;
+        } else if (argc > 2 && strcmp(argv[1], "--measures") == 0) {
+            if (!parse_measures(argv[2], &select)) {
+                fprintf(stderr, "musicparse: bad --measures %s\n", argv[2]);
+                return 1;
+            }
+            argc--;
+            argv++;
+        } else if (argc > 2 && strcmp(argv[1], "--repeats") == 0) {
+            if (!parse_repeats(argv[2], &repeats)) {
+                fprintf(stderr, "musicparse: bad --repeats %s\n", argv[2]);
+                return 1;
+            }
+            argc--;
+            argv++;
+        } else if (argc > 2 && strcmp(argv[1], "--vocab") == 0) {
+            if (write_vocab(argv[2]) != 0) return 1;
+            vocab = true;
+            argc--;
+            argv++;
+        } else {
+            break;
         }
-        file.close();
-    } else {
-        return 1;
+        argc--;
+        argv++;
+    }
+    if (argc < 2) return vocab ? 0 : 1; // --vocab alone just writes the vocabulary.
+    if (strcmp(argv[1], "--expand") == 0) return argc > 2 ? expand(argv[2], stdout) : 1;
+
+    if (strcmp(argv[1], "--batch") == 0) {
+        batch_options opts;
+        opts.source = NULL;
+        opts.out_dir = NULL;
+        opts.chorales = false;
+        opts.ml_flag = false;
+        opts.stream = stream;
+        opts.stats = stats;
+        opts.stats_per_file = false;
+        opts.cache_dir = cache_dir;
+        opts.emit_score = false;
+        opts.tokens = tokens;
+        opts.shards = 0;
+        opts.transpose_keys = 0;
+        opts.jobs = 0;
+        opts.merge_threads = threads;
+        opts.select = select;
+        opts.repeats = repeats;
+
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+                opts.source = argv[++i];
+            } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+                opts.out_dir = argv[++i];
+            } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+                if (!parse_count(argv[++i], MAX_THREADS, &opts.jobs)) {
+                    fprintf(stderr, "musicparse: bad --jobs %s\n", argv[i]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                if (!parse_count(argv[++i], MAX_THREADS, &opts.merge_threads)) {
+                    fprintf(stderr, "musicparse: bad --threads %s\n", argv[i]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--parts") == 0 && i + 1 < argc) {
+                if (!parse_parts(argv[++i], &opts.select)) {
+                    fprintf(stderr, "musicparse: bad --parts %s\n", argv[i]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--measures") == 0 && i + 1 < argc) {
+                if (!parse_measures(argv[++i], &opts.select)) {
+                    fprintf(stderr, "musicparse: bad --measures %s\n", argv[i]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--repeats") == 0 && i + 1 < argc) {
+                if (!parse_repeats(argv[++i], &opts.repeats)) {
+                    fprintf(stderr, "musicparse: bad --repeats %s\n", argv[i]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc) {
+                opts.chorales = strcmp(argv[++i], "chorales") == 0;
+            } else if (strcmp(argv[i], "--stream") == 0) {
+                opts.stream = true;
+            } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+                opts.cache_dir = argv[++i];
+            } else if (strcmp(argv[i], "--transpose") == 0 && i + 1 < argc) {
+                const char* keys = argv[++i];
+                if (strcmp(keys, "all") == 0 || strcmp(keys, "15") == 0) {
+                    opts.transpose_keys = 15;
+                } else if (strcmp(keys, "12") == 0) {
+                    opts.transpose_keys = 12;
+                } else {
+                    fprintf(stderr, "musicparse: bad --transpose %s\n", keys);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--tokens") == 0) {
+                opts.tokens = true;
+            } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+                if (!parse_count(argv[++i], MAX_SHARDS, &opts.shards)) {
+                    fprintf(stderr, "musicparse: bad --shards %s\n", argv[i]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--vocab") == 0 && i + 1 < argc) {
+                if (write_vocab(argv[++i]) != 0) return 1;
+            } else if (strcmp(argv[i], "--emit") == 0 && i + 1 < argc) {
+                opts.emit_score = strcmp(argv[++i], "score") == 0;
+            } else if (strcmp(argv[i], "--stats") == 0) {
+                opts.stats = true;
+            } else if (strcmp(argv[i], "--stats-per-file") == 0) {
+                opts.stats = true;
+                opts.stats_per_file = true;
+            } else if (i + 1 == argc && (strcmp(argv[i], "0") == 0 || strcmp(argv[i], "1") == 0)) {
+                opts.ml_flag = argv[i][0] == '1';
+            } else {
+                fprintf(stderr, takes_value(argv[i]) ? "musicparse: %s needs a value\n" : "musicparse: unknown option %s\n", argv[i]);
+                return 1;
+            }
+        }
+        if (!opts.source) return 1;
+#ifdef MP_NO_STATS
+        if (opts.stats) fprintf(stderr, "musicparse: built without stats (STATS=0)\n");
+#endif
+        return run_batch(&opts);
     }
 
-    if (init_parse(fil_str) == 0) {
-        note_parse(fil_str);
-        merge_measures();
+    parse_context ctx;
+    init_context(&ctx);
+    ctx.merge_threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    ctx.select = select;
+
+    render_options opts;
+    opts.ml_flag = !(argc == 2 || atoi(argv[2]) == 0);
+    opts.tokens = tokens;
+    opts.key_override = NULL;
+    opts.repeats = repeats;
+    opts.stats = &ctx.stats;
+    int failed;
+    if (score_path) {
+        FILE* out = fopen(score_path, "wb");
+        failed = out ? compile(&ctx, argv[1], out) : 1;
+        if (out) failed |= fclose(out) != 0;
+    } else {
+        failed = convert(&ctx, argv[1], &opts, stream, cache_dir, stdout);
     }
 
-    delete fil_str;
-    return display();
+    if (stats) {
+#ifdef MP_NO_STATS
+        fprintf(stderr, "musicparse: built without stats (STATS=0)\n");
+#else
+        fflush(stdout);
+        fprintf(stderr, "%s\n", stats_json(&ctx.stats, argv[1]).c_str());
+#endif
+    }
+    return failed;
 }
+
@@ -0,0 +1,3382 @@
+#include "musicparse.h"
+
+#include <algorithm>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MP_X86_SIMD 1
+#endif
+
+#define S_DIVISIONS "divisions"
+#define S_BEAT_TYPE "beat-type"
+#define S_FIFTHS "fifths"
+#define S_MODE "mode"
+#define S_BEATS "beats"
+
+#define S_ATTRIBUTES "attributes"
+
+#define S_PART "part"
+#define S_MEASURE "measure"
+#define S_NUMBER "number"
+#define S_NOTE "note"
+#define S_PITCH "pitch"
+#define S_STEP "step"
+#define S_OCTAVE "octave"
+#define S_ALTER "alter"
+#define S_DURATION "duration"
+#define S_VOICE "voice"
+#define S_REST "rest"
+
+#define S_SCORE_PART "score-part"
+#define S_SCORE_TIMEWISE "score-timewise"
+#define S_ID "id"
+
+typedef enum {
+    TAG,
+    BEATS, // # of Beats in a measure
+    BEAT_TYPE, // Subdivisions
+    DIVISIONS, // # Divisions Per "Duration"
+    KEY_T, // KEY TONIC
+    KEY_M // KEY MODALITY
+} init_state;
+
+typedef enum {
+    PART, // Detect part
+    MEASURE, // If <measure> tag is reached
+    NOTE, // When <note> tag is reached
+    PITCH, // When <Pitch> tag is reached
+    STEP, // When <step> tag is reached (indicates actual pitch)
+    ALTER, // Indicates accidental.
+    OCTAVE, // When <octave> tag is reached.
+    DURATION, // Indicates length of note (use division by init_params)
+    VOICE // Indicates what voice this is in if the voice itself is polyphonic.
+} note_state;
+
+typedef enum {
+    T_OTHER, // Any tag the parser does not act on.
+    T_DIVISIONS,
+    T_BEAT_TYPE,
+    T_FIFTHS,
+    T_MODE,
+    T_BEATS,
+    T_ATTRIBUTES,
+    T_PART,
+    T_MEASURE,
+    T_NOTE,
+    T_PITCH,
+    T_STEP,
+    T_OCTAVE,
+    T_ALTER,
+    T_DURATION,
+    T_VOICE,
+    T_REST,
+    T_SCORE_PART,
+    T_SCORE_TIMEWISE,
+    T_SKIPPED // Layout/text subtrees (<print>, <direction>, <lyric>, ...) the tokenizer jumps over.
+} tag_id;
+
+typedef enum {
+    XML_OPEN, // <tag attr="value"> (a self-closing <tag/> is reported as XML_OPEN followed by XML_CLOSE)
+    XML_CLOSE, // </tag>
+    XML_TEXT // Character data between two tags.
+} xml_event_type;
+
+typedef struct __xmlevent__ {
+    xml_event_type type;
+    tag_id id; // Identifies the tag of an XML_OPEN/XML_CLOSE event.
+    str_view tag; // Tag name of an XML_OPEN/XML_CLOSE event.
+    std::vector<xml_attribute> attributes; // Attributes of an XML_OPEN event.
+    str_view text; // Character data of an XML_TEXT event.
+} xml_event;
+
+typedef struct __xmltokenizer__ {
+    const char* pos; // Next byte to scan.
+    const char* end; // One past the last byte of the input.
+    bool pending_close; // The last XML_OPEN was self-closing; report its XML_CLOSE next.
+} xml_tokenizer;
+
+// build_index's place in a document, kept apart so that a parse can index the document as it reads it.
+typedef struct __indexbuilder__ {
+    file_index* index;
+    const char* doc;
+    std::vector<size_t> open; // Spans of the elements still open, innermost last.
+    bool timewise;
+    uint32_t number; // The number an unnumbered <measure> takes.
+} index_builder;
+
+// Text on its way out. display_* append to data, which goes to sink in large chunks (or, without a sink,
+// is the rendered text itself).
+typedef struct __outbuffer__ {
+    std::string data;
+    FILE* sink;
+    bool failed; // A write to sink came up short.
+} out_buffer;
+
+typedef struct __repeatentry__ {
+    uint64_t check; // The other half of the hash of its beats.
+    uint64_t position; // Measures written before it.
+    uint32_t measure_num;
+} repeat_entry;
+
+// The measures render_options.repeats can refer back to, by a hash of their beats.
+typedef struct __repeattable__ {
+    std::unordered_map<uint64_t, repeat_entry> seen; // The last measure written with each hash.
+    uint64_t written;
+} repeat_table;
+
+typedef struct __renderstate__ {
+    score_view piece;
+    const render_options* opts;
+    out_buffer* out;
+    repeat_table* repeats; // NULL unless opts->repeats is set.
+} render_state;
+
+typedef struct __parsestate__ {
+    parse_context* ctx;
+    int16_t part; // Index of the <part> currently being read, -1 before the first one.
+
+    // <attributes> handling (init_parse).
+    init_state init;
+    init_params params; // Running attributes. Carried over to later parts like the MusicXML itself does.
+    std::vector<bool> params_set; // Whether part_params[i] has been filled by the part's own <attributes>.
+
+    // <part>/<measure>/<note> handling (note_parse).
+    note_state state;
+    measure measure_obj;
+    chord notes;
+    note note_obj;
+    uint16_t div_count;
+    size_t note_count;
+
+    // <score-timewise> puts every part inside each measure, so parts are told apart by id and each one's
+    // div_count is kept between its measures.
+    bool timewise;
+    bool new_part; // The <part> just opened has not been seen before.
+    std::vector<str_view> part_ids;
+    std::vector<uint16_t> part_div_counts;
+    size_t last_row; // Row of the measure table the last finished measure went into.
+
+    // Parts and measures left out by ctx->select are jumped over, straight to their ends when index has them.
+    const char* doc; // Start of the document.
+    const file_index* index; // NULL without a usable index.
+    size_t span; // The first entry of index that can still match a tag.
+
+    // Streaming (parse_stream) only; stream is NULL otherwise.
+    render_state* stream;
+    size_t part_count; // <score-part> entries in <part-list>. 0 if there is none.
+    std::vector<bool> row_done; // Whether every part has delivered the row.
+    size_t next_row; // First row not written yet.
+    uint8_t max_duration;
+    bool started; // The M:/K: header has been written.
+    size_t written; // Measures written so far.
+} parse_state;
+
+// Global headers.
+
+#ifdef MP_COUNT_ALLOCS
+// Debug builds (make COUNT_ALLOCS=1) count every operator new to check the parse path for allocations.
+std::atomic<size_t> alloc_count(0);
+
+void* operator new(size_t size) {
+    alloc_count++;
+    void* p = malloc(size ? size : 1);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+#endif
+
+// Key names by fifths + 7, as written on the K: line.
+constexpr const char* major_names[15] = {"C♭", "G♭", "D♭", "A♭", "E♭", "B♭", "F", "C", "G", "D", "A", "E", "B", "F#", "C#"};
+constexpr const char* minor_names[15] = {"a♭", "e♭", "b♭", "f", "c", "g", "d", "a", "e", "b", "f#", "c#", "g#", "d#", "a#"};
+
+// Accidentals by alter + 2, with their lengths in bytes. Other alters are written without one.
+constexpr const char* accidental_names[5] = {"♭♭", "♭", "♮", "#", "x"};
+constexpr uint8_t accidental_lengths[5] = {sizeof("♭♭") - 1, sizeof("♭") - 1, sizeof("♮") - 1, sizeof("#") - 1, sizeof("x") - 1};
+
+// Letters A to G as steps from C.
+constexpr uint8_t step_indices[7] = {5, 6, 0, 1, 2, 3, 4};
+
+/**
+ * The output modes the render stage is compiled for. display_beats and everything under it are instantiated once
+ * per mode, so what a mode writes for each note is settled at compile time; display_measure picks the mode.
+ */
+template <bool TOKENS, bool ML>
+struct render_mode {
+    static constexpr bool tokens = TOKENS; // Token IDs rather than text.
+    static constexpr bool ml = ML; // Without octaves and rests.
+};
+typedef render_mode<false, false> text_mode;
+typedef render_mode<false, true> ml_text_mode;
+typedef render_mode<true, false> token_mode;
+typedef render_mode<true, true> ml_token_mode;
+
+// Buffered bytes that make display_measure hand the buffer to its sink.
+const size_t OUT_CHUNK = 1 << 16;
+
+tag_id lookup_tag(const char* name, size_t len);
+bool parse_int(str_view s, int32_t* out);
+bool view_equals(str_view s, const char* literal);
+
+void init_tokenizer(xml_tokenizer* tk, const input_buffer* input);
+bool next_event(xml_tokenizer* tk, xml_event* ev);
+
+void clear_beats(beat_list& bl);
+void merge_row(const parse_context* ctx, size_t row, uint8_t max_duration, merge_work& work, score* out, conv_stats* stats);
+uint8_t max_division(const parse_context* ctx);
+
+void init_parse(parse_state* ps, const xml_event* ev);
+void note_parse(parse_state* ps, const xml_event* ev);
+
+void out_flush(out_buffer* ob);
+inline void out_token(out_buffer* ob, uint16_t id);
+void display_part(render_state* rs, init_params p);
+template <typename Mode> void display_note(out_buffer* ob, note nt);
+template <typename Mode> void display_chord(out_buffer* ob, const note* begin, const note* end, uint16_t duration, uint8_t division);
+template <typename Mode> void display_beats(render_state* rs, const measure& m);
+void display_measure(render_state* rs, const measure& msur);
+bool display_repeat(render_state* rs, const measure& m);
+
+uint16_t nearest_bin_power(uint16_t n) {
+    n--;
+    n |= n >> 1;
+    n |= n >> 2;
+    n |= n >> 4;
+    n |= n >> 8;
+    n |= n >> 16;
+    n = (++n) >> 1;
+
+    return n;
+}
+
+static uint16_t read_u16(const char* p) {
+    const unsigned char* u = (const unsigned char*) p;
+    return (uint16_t) (u[0] | u[1] << 8);
+}
+
+static uint32_t read_u32(const char* p) {
+    const unsigned char* u = (const unsigned char*) p;
+    return (uint32_t) u[0] | (uint32_t) u[1] << 8 | (uint32_t) u[2] << 16 | (uint32_t) u[3] << 24;
+}
+
+// A member of a zip archive, as its central directory describes it.
+typedef struct __zipentry__ {
+    str_view name;
+    uint16_t method; // 0 stored, 8 deflated.
+    uint32_t crc;
+    uint32_t compressed_size;
+    uint32_t size;
+    uint32_t header_offset; // Of its local header.
+} zip_entry;
+
+// Zip archives start with a local file header.
+static bool is_mxl(const input_buffer* buf) {
+    return buf->size >= 4 && read_u32(buf->data) == 0x04034b50;
+}
+
+/**
+ * Reads the central directory of the zip archive in [data, data + size) into entries. Returns 1 if it is
+ * not a zip archive this can read (ZIP64 archives and multi-disk ones are not).
+ */
+static int read_zip(const char* data, size_t size, std::vector<zip_entry>& entries) {
+    const size_t END_SIZE = 22;
+    if (size < END_SIZE) return 1;
+
+    // The end record sits behind a comment of up to 64 KB.
+    const char* end = NULL;
+    for (size_t off = size - END_SIZE;; off--) {
+        if (read_u32(data + off) == 0x06054b50) {
+            end = data + off;
+            break;
+        }
+        if (off == 0 || size - off >= END_SIZE + 0xffff) break;
+    }
+    if (!end) return 1;
+
+    uint16_t count = read_u16(end + 10);
+    uint32_t dir_offset = read_u32(end + 16);
+    if (dir_offset > size) return 1;
+
+    const char* p = data + dir_offset;
+    for (uint16_t i = 0; i < count; i++) {
+        if ((size_t) (data + size - p) < 46 || read_u32(p) != 0x02014b50) return 1;
+        zip_entry e;
+        e.method = read_u16(p + 10);
+        e.crc = read_u32(p + 16);
+        e.compressed_size = read_u32(p + 20);
+        e.size = read_u32(p + 24);
+        e.header_offset = read_u32(p + 42);
+        size_t name_len = read_u16(p + 28);
+        size_t skip = 46 + name_len + read_u16(p + 30) + read_u16(p + 32);
+        if ((size_t) (data + size - p) < skip) return 1;
+        e.name.data = p + 46;
+        e.name.len = name_len;
+        entries.push_back(e);
+        p += skip;
+    }
+    return 0;
+}
+
+/**
+ * Inflates (or copies) one member of the archive into a new heap buffer. Returns NULL if its data runs past
+ * the archive, uses a method other than store and deflate, declares a size its data cannot inflate to, or
+ * fails its CRC.
+ */
+static char* extract_zip(const char* data, size_t size, const zip_entry& e) {
+    if ((size_t) e.header_offset + 30 > size || read_u32(data + e.header_offset) != 0x04034b50) return NULL;
+    size_t start = (size_t) e.header_offset + 30 + read_u16(data + e.header_offset + 26) + read_u16(data + e.header_offset + 28);
+    if (start > size || e.compressed_size > size - start) return NULL;
+    if (e.method != 0 && e.method != 8) return NULL;
+    // Deflate packs at most 1032 bytes into one, so a larger size is a lie that would only cost memory.
+    if (e.method == 0 ? e.size != e.compressed_size : e.size > (uint64_t) e.compressed_size * 1032) return NULL;
+
+    char* out = (char*) malloc(e.size ? e.size : 1);
+    if (!out) return NULL;
+
+    bool ok = true;
+    if (e.method == 0) {
+        memcpy(out, data + start, e.size);
+    } else {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        ok = inflateInit2(&zs, -MAX_WBITS) == Z_OK; // Raw deflate, no zlib header.
+        if (ok) {
+            zs.next_in = (Bytef*) (data + start);
+            zs.avail_in = e.compressed_size;
+            zs.next_out = (Bytef*) out;
+            zs.avail_out = e.size;
+            ok = inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == e.size;
+            inflateEnd(&zs);
+        }
+    }
+
+    if (!ok || crc32(crc32(0L, Z_NULL, 0), (const Bytef*) out, e.size) != e.crc) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * Replaces the .mxl archive in buf with the score it holds: the first rootfile META-INF/container.xml names,
+ * or failing that the first .xml member outside META-INF. Returns 1 if there is no score to be had.
+ */
+static int open_mxl(input_buffer* buf) {
+    std::vector<zip_entry> entries;
+    if (read_zip(buf->data, buf->size, entries) != 0) return 1;
+
+    std::string root;
+    for (const auto& e : entries) {
+        if (!view_equals(e.name, "META-INF/container.xml")) continue;
+        char* container = extract_zip(buf->data, buf->size, e);
+        if (!container) return 1;
+
+        std::string text(container, e.size);
+        free(container);
+        size_t at = text.find("full-path", text.find("<rootfile"));
+        size_t open_quote = text.find_first_of("\"'", at);
+        if (at != std::string::npos && open_quote != std::string::npos) {
+            size_t close_quote = text.find(text[open_quote], open_quote + 1);
+            if (close_quote != std::string::npos) root = text.substr(open_quote + 1, close_quote - open_quote - 1);
+        }
+    }
+
+    const zip_entry* score_entry = NULL;
+    for (const auto& e : entries) {
+        std::string name(e.name.data, e.name.len);
+        if (root.empty() ? (name.compare(0, 9, "META-INF/") != 0 && name.size() > 4 && name.compare(name.size() - 4, 4, ".xml") == 0)
+                         : name == root) {
+            score_entry = &e;
+            break;
+        }
+    }
+    if (!score_entry) return 1;
+
+    char* xml = extract_zip(buf->data, buf->size, *score_entry);
+    if (!xml) return 1;
+
+    close_input(buf);
+    buf->data = xml;
+    buf->size = score_entry->size;
+    buf->mapped = false;
+    return 0;
+}
+
+// Unpacks an .mxl archive in buf, closing buf if that fails.
+static int unpack_input(input_buffer* buf) {
+    if (!is_mxl(buf) || open_mxl(buf) == 0) return 0;
+    close_input(buf);
+    return 1;
+}
+
+/**
+ * Opens the input for parsing. Regular files are memory-mapped so the parsers scan the file bytes
+ * in place; pipes, stdin ("-") and anything that cannot be mapped are streamed into one heap buffer.
+ * A compressed MusicXML (.mxl) archive, from a file or a pipe alike, is inflated into a heap buffer.
+ */
+int open_input(const char* path, input_buffer* buf) {
+    buf->data = NULL;
+    buf->size = 0;
+    buf->mapped = false;
+
+    int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) return 1;
+
+    struct stat st;
+    if (fd != STDIN_FILENO && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* addr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, (size_t) st.st_size, MADV_SEQUENTIAL);
+            buf->data = (const char*) addr;
+            buf->size = (size_t) st.st_size;
+            buf->mapped = true;
+            close(fd);
+            return unpack_input(buf);
+        }
+    }
+
+    // Streamed fallback.
+    size_t capacity = 1 << 16;
+    char* data = (char*) malloc(capacity);
+    ssize_t n = 0;
+    while (data != NULL && (n = read(fd, data + buf->size, capacity - buf->size)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        buf->size += (size_t) n;
+        if (buf->size == capacity) {
+            capacity *= 2;
+            char* grown = (char*) realloc(data, capacity);
+            if (grown == NULL) free(data);
+            data = grown;
+        }
+    }
+    if (fd != STDIN_FILENO) close(fd);
+
+    if (data == NULL || n < 0) {
+        free(data);
+        return 1;
+    }
+
+    buf->data = data;
+    return unpack_input(buf);
+}
+
+void close_input(input_buffer* buf) {
+    if (buf->data == NULL) return;
+
+    if (buf->mapped) {
+        munmap((void*) buf->data, buf->size);
+    } else {
+        free((void*) buf->data);
+    }
+    buf->data = NULL;
+    buf->size = 0;
+}
+
+/**
+ * Delimiter scanners used by the tokenizer. Each returns the first match in [p, end) or end if there is none.
+ * find_char looks for a single byte; find_pair looks for two adjacent bytes (used to find "</"); find_name_end
+ * looks for the end of a tag or attribute name. The widest implementation the CPU supports is picked once at
+ * runtime by scanner().
+ */
+typedef struct __scanops__ {
+    const char* (*find_char)(const char* p, const char* end, char c);
+    const char* (*find_pair)(const char* p, const char* end, char c1, char c2);
+    const char* (*find_name_end)(const char* p, const char* end);
+} scan_ops;
+
+// Whitespace (and any other control byte), '/', '=' and '>' end a name.
+static inline bool is_name_end(char c) {
+    return (unsigned char) c <= ' ' || c == '/' || c == '=' || c == '>';
+}
+
+static const char* find_name_end_scalar(const char* p, const char* end) {
+    while (p < end && !is_name_end(*p)) p++;
+    return p;
+}
+
+static const char* find_char_scalar(const char* p, const char* end, char c) {
+    while (p < end && *p != c) p++;
+    return p;
+}
+
+static const char* find_pair_scalar(const char* p, const char* end, char c1, char c2) {
+    while (p + 1 < end && (p[0] != c1 || p[1] != c2)) p++;
+    return (p + 1 < end) ? p : end;
+}
+
+#ifdef MP_X86_SIMD
+static const char* find_char_sse2(const char* p, const char* end, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_char_scalar(p, end, c);
+}
+
+static const char* find_pair_sse2(const char* p, const char* end, char c1, char c2) {
+    const __m128i first = _mm_set1_epi8(c1);
+    const __m128i second = _mm_set1_epi8(c2);
+    while (end - p >= 17) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        __m128i next = _mm_loadu_si128((const __m128i*) (p + 1));
+        __m128i hits = _mm_and_si128(_mm_cmpeq_epi8(block, first), _mm_cmpeq_epi8(next, second));
+        unsigned mask = (unsigned) _mm_movemask_epi8(hits);
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_pair_scalar(p, end, c1, c2);
+}
+
+static const char* find_name_end_sse2(const char* p, const char* end) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i equals = _mm_set1_epi8('=');
+    const __m128i gt = _mm_set1_epi8('>');
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        __m128i hits = _mm_cmpeq_epi8(_mm_min_epu8(block, space), block); // Bytes up to ' '.
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, slash));
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, equals));
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, gt));
+        unsigned mask = (unsigned) _mm_movemask_epi8(hits);
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_name_end_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* find_char_avx2(const char* p, const char* end, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) p);
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_char_sse2(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static const char* find_pair_avx2(const char* p, const char* end, char c1, char c2) {
+    const __m256i first = _mm256_set1_epi8(c1);
+    const __m256i second = _mm256_set1_epi8(c2);
+    while (end - p >= 33) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) p);
+        __m256i next = _mm256_loadu_si256((const __m256i*) (p + 1));
+        __m256i hits = _mm256_and_si256(_mm256_cmpeq_epi8(block, first), _mm256_cmpeq_epi8(next, second));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(hits);
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_pair_sse2(p, end, c1, c2);
+}
+
+__attribute__((target("avx2")))
+static const char* find_name_end_avx2(const char* p, const char* end) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i equals = _mm256_set1_epi8('=');
+    const __m256i gt = _mm256_set1_epi8('>');
+    while (end - p >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) p);
+        __m256i hits = _mm256_cmpeq_epi8(_mm256_min_epu8(block, space), block); // Bytes up to ' '.
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, slash));
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, equals));
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, gt));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(hits);
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_name_end_sse2(p, end);
+}
+#endif
+
+const scan_ops* scanner() {
+    static const scan_ops ops = []() {
+        scan_ops o = {find_char_scalar, find_pair_scalar, find_name_end_scalar};
+#ifdef MP_X86_SIMD
+        o.find_char = find_char_sse2;
+        o.find_pair = find_pair_sse2;
+        o.find_name_end = find_name_end_sse2;
+        if (__builtin_cpu_supports("avx2")) {
+            o.find_char = find_char_avx2;
+            o.find_pair = find_pair_avx2;
+            o.find_name_end = find_name_end_avx2;
+        }
+#endif
+        return o;
+    }();
+    return &ops;
+}
+
+#define TAG_IS(s) (len == sizeof(s) - 1 && memcmp(name, s, sizeof(s) - 1) == 0)
+
+/**
+ * Maps a tag name to its tag_id. Switching on the first byte leaves at most a couple of
+ * length-checked memcmp calls per tag.
+ */
+tag_id lookup_tag(const char* name, size_t len) {
+    if (len == 0) return T_OTHER;
+
+    switch (name[0]) {
+        case 'a':
+            if (TAG_IS(S_ALTER)) return T_ALTER;
+            if (TAG_IS(S_ATTRIBUTES)) return T_ATTRIBUTES;
+            break;
+        case 'b':
+            if (TAG_IS(S_BEATS)) return T_BEATS;
+            if (TAG_IS(S_BEAT_TYPE)) return T_BEAT_TYPE;
+            if (TAG_IS("barline")) return T_SKIPPED;
+            break;
+        case 'c':
+            if (TAG_IS("credit")) return T_SKIPPED;
+            break;
+        case 'd':
+            if (TAG_IS(S_DURATION)) return T_DURATION;
+            if (TAG_IS(S_DIVISIONS)) return T_DIVISIONS;
+            if (TAG_IS("direction") || TAG_IS("defaults")) return T_SKIPPED;
+            break;
+        case 'f':
+            if (TAG_IS(S_FIFTHS)) return T_FIFTHS;
+            if (TAG_IS("figured-bass")) return T_SKIPPED;
+            break;
+        case 'h':
+            if (TAG_IS("harmony")) return T_SKIPPED;
+            break;
+        case 'i':
+            if (TAG_IS("identification")) return T_SKIPPED;
+            break;
+        case 'l':
+            if (TAG_IS("lyric")) return T_SKIPPED;
+            break;
+        case 'm':
+            if (TAG_IS(S_MEASURE)) return T_MEASURE;
+            if (TAG_IS(S_MODE)) return T_MODE;
+            break;
+        case 'n':
+            if (TAG_IS(S_NOTE)) return T_NOTE;
+            if (TAG_IS("notations")) return T_SKIPPED;
+            break;
+        case 'o':
+            if (TAG_IS(S_OCTAVE)) return T_OCTAVE;
+            break;
+        case 'p':
+            if (TAG_IS(S_PITCH)) return T_PITCH;
+            if (TAG_IS(S_PART)) return T_PART;
+            if (TAG_IS("print")) return T_SKIPPED;
+            break;
+        case 'r':
+            if (TAG_IS(S_REST)) return T_REST;
+            break;
+        case 's':
+            if (TAG_IS(S_STEP)) return T_STEP;
+            if (TAG_IS(S_SCORE_PART)) return T_SCORE_PART;
+            if (TAG_IS(S_SCORE_TIMEWISE)) return T_SCORE_TIMEWISE;
+            break;
+        case 'v':
+            if (TAG_IS(S_VOICE)) return T_VOICE;
+            break;
+        case 'w':
+            if (TAG_IS("work")) return T_SKIPPED;
+            break;
+        default:
+            break;
+    }
+    return T_OTHER;
+}
+
+#undef TAG_IS
+
+/**
+ * Parses a base-10 integer the way std::from_chars does, without allocating or throwing.
+ * Leading whitespace is skipped and anything after the digits is ignored.
+ * Returns false (leaving *out untouched) if there are no digits.
+ */
+bool parse_int(str_view s, int32_t* out) {
+    const char* p = s.data;
+    const char* end = s.data + s.len;
+    while (p < end && isspace((unsigned char) *p)) p++;
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+    if (p == end || *p < '0' || *p > '9') return false;
+
+    int32_t value = 0;
+    while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+    *out = negative ? -value : value;
+    return true;
+}
+
+bool view_equals(str_view s, const char* literal) {
+    size_t len = strlen(literal);
+    return s.len == len && memcmp(s.data, literal, len) == 0;
+}
+
+/**
+ * Returns the byte after the </name> that closes an element whose start tag ended just before p.
+ */
+static const char* skip_element(const char* p, const char* end, const char* name, size_t len) {
+    const scan_ops* ops = scanner();
+    while ((p = ops->find_pair(p, end, '<', '/')) < end) {
+        const char* q = p + 2;
+        if ((size_t) (end - q) > len && memcmp(q, name, len) == 0 && (q[len] == '>' || isspace((unsigned char) q[len]))) {
+            const char* close = ops->find_char(q + len, end, '>');
+            return (close < end) ? close + 1 : end;
+        }
+        p = q;
+    }
+    return end;
+}
+
+void init_tokenizer(xml_tokenizer* tk, const input_buffer* input) {
+    tk->pos = input->data;
+    tk->end = input->data + input->size;
+    tk->pending_close = false;
+}
+
+/**
+ * Reads the next event from the input. Comments, processing instructions and declarations are skipped,
+ * as are runs of whitespace between tags and the T_SKIPPED subtrees. Returns false once the input is exhausted.
+ *
+ * Tag names, attributes and text are views into the input; ev->attributes keeps its capacity between
+ * calls, so a reused event does not allocate once it has seen the widest tag.
+ */
+bool next_event(xml_tokenizer* tk, xml_event* ev) {
+    if (tk->pending_close) {
+        tk->pending_close = false;
+        ev->type = XML_CLOSE;
+        ev->attributes.clear();
+        return true;
+    }
+
+    const scan_ops* ops = scanner();
+    const char* end = tk->end;
+    while (tk->pos < end) {
+        const char* p = tk->pos;
+
+        // Character data.
+        if (*p != '<') {
+            // Most runs are the indentation between two tags, which is over before a vector scan would start.
+            const char* s = p;
+            while (s < end && (*s == ' ' || *s == '\n' || *s == '\t' || *s == '\r')) s++;
+            if (s == end || *s == '<') {
+                tk->pos = s;
+                continue;
+            }
+            const char* lt = ops->find_char(s, end, '<');
+            tk->pos = lt;
+            while (s < lt && isspace((unsigned char) *s)) s++;
+            if (s == lt) continue;
+
+            ev->type = XML_TEXT;
+            ev->text.data = p;
+            ev->text.len = lt - p;
+            return true;
+        }
+
+        p++;
+        if (p < end && (*p == '?' || *p == '!')) {
+            const char* close = NULL;
+            if (end - p >= 3 && memcmp(p, "!--", 3) == 0) {
+                for (const char* q = p + 3; q + 2 < end && close == NULL; q++) {
+                    if (q[0] == '-' && q[1] == '-' && q[2] == '>') close = q + 2;
+                }
+            } else {
+                // <?xml ...?> and <!DOCTYPE ...>, which may carry an internal [subset].
+                int depth = 0;
+                for (const char* q = p; q < end && close == NULL; q++) {
+                    if (*q == '[') depth++;
+                    else if (*q == ']') depth--;
+                    else if (*q == '>' && depth <= 0) close = q;
+                }
+            }
+            tk->pos = (close == NULL) ? end : close + 1;
+            continue;
+        }
+
+        bool closing = (p < end && *p == '/');
+        if (closing) p++;
+
+        const char* name = p;
+        p = ops->find_name_end(p, end);
+        tag_id id = lookup_tag(name, p - name);
+
+        if (!closing && id == T_SKIPPED) {
+            const char* gt = ops->find_char(p, end, '>');
+            if (gt < end && gt[-1] == '/') {
+                tk->pos = gt + 1;
+            } else {
+                tk->pos = (gt < end) ? skip_element(gt + 1, end, name, p - name) : end;
+            }
+            continue;
+        }
+
+        ev->id = id;
+        ev->tag.data = name;
+        ev->tag.len = p - name;
+        ev->attributes.clear();
+
+        if (closing) {
+            p = ops->find_char(p, end, '>');
+            tk->pos = (p < end) ? p + 1 : end;
+            ev->type = XML_CLOSE;
+            return true;
+        }
+
+        // Attributes, up to '>' or '/>'.
+        while (p < end && *p != '>') {
+            if (isspace((unsigned char) *p)) {
+                p++;
+                continue;
+            }
+            if (*p == '/') {
+                tk->pending_close = true;
+                p++;
+                continue;
+            }
+
+            const char* attr = p;
+            p = ops->find_name_end(p, end);
+            if (p == attr && *p != '=') p++; // A stray control byte where a name should be.
+            const char* attr_end = p;
+            while (p < end && isspace((unsigned char) *p)) p++;
+            if (p >= end || *p != '=') continue;
+
+            p++;
+            while (p < end && isspace((unsigned char) *p)) p++;
+            if (p >= end || (*p != '"' && *p != '\'')) continue;
+
+            char quote = *p++;
+            const char* value = p;
+            p = ops->find_char(p, end, quote);
+
+            xml_attribute a;
+            a.name.data = attr;
+            a.name.len = attr_end - attr;
+            a.value.data = value;
+            a.value.len = p - value;
+            ev->attributes.push_back(a);
+
+            if (p < end) p++;
+        }
+
+        tk->pos = (p < end) ? p + 1 : end;
+        ev->type = XML_OPEN;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Handles the events that make up <attributes>. Each part's first <attributes> block sets its part_params entry.
+ */
+void init_parse(parse_state* ps, const xml_event* ev) {
+    parse_context* ctx = ps->ctx;
+    int32_t value;
+
+    switch (ev->type) {
+        case XML_OPEN:
+            switch (ev->id) {
+                case T_DIVISIONS:
+                    ps->init = DIVISIONS;
+                    break;
+                case T_FIFTHS:
+                    ps->init = KEY_T;
+                    break;
+                case T_MODE:
+                    ps->init = KEY_M;
+                    break;
+                case T_BEATS:
+                    ps->init = BEATS;
+                    break;
+                case T_BEAT_TYPE:
+                    ps->init = BEAT_TYPE;
+                    break;
+                case T_PART:
+                    // Parts without their own <attributes> inherit the running ones.
+                    if (ps->new_part) {
+                        ctx->part_params.push_back(ps->params);
+                        ps->params_set.push_back(false);
+                    }
+                    ps->init = TAG;
+                    break;
+                default:
+                    ps->init = TAG;
+                    break;
+            }
+            break;
+        case XML_TEXT:
+            if (ps->init == KEY_M) {
+                ps->params.major = view_equals(ev->text, "major");
+            } else if (ps->init != TAG && parse_int(ev->text, &value)) {
+                switch (ps->init) {
+                    case BEATS:
+                        ps->params.beats = (uint16_t) value;
+                        break;
+                    case BEAT_TYPE:
+                        ps->params.beat_type = (uint16_t) value;
+                        break;
+                    case DIVISIONS:
+                        ps->params.division_count = (uint8_t) value;
+                        break;
+                    case KEY_T:
+                        ps->params.key_center = (int8_t) value;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            ps->init = TAG;
+            break;
+        case XML_CLOSE:
+            if (ev->id == T_ATTRIBUTES && ps->part >= 0 && !ps->params_set[ps->part]) {
+                ctx->part_params[ps->part] = ps->params;
+                ps->params_set[ps->part] = true;
+            }
+            ps->init = TAG;
+            break;
+    }
+}
+
+void clear_index(row_index* index) {
+    index->used = 0;
+    if (++index->generation == 0) {
+        for (auto& slot : index->slots) slot.generation = 0;
+        index->generation = 1;
+    }
+}
+
+static index_slot* find_slot(row_index* index, uint32_t measure_num) {
+    size_t mask = index->slots.size() - 1;
+    for (size_t i = (measure_num * 2654435761u) & mask;; i = (i + 1) & mask) {
+        index_slot& slot = index->slots[i];
+        if (slot.generation != index->generation || slot.measure_num == measure_num) return &slot;
+    }
+}
+
+/**
+ * The row of measure_num, which becomes new_row if it has none yet. The index doubles once it is half full.
+ */
+size_t index_row(row_index* index, uint32_t measure_num, size_t new_row) {
+    if (2 * (index->used + 1) > index->slots.size()) {
+        std::vector<index_slot> old;
+        old.swap(index->slots);
+        uint32_t old_generation = index->generation;
+        index_slot empty = {0, 0, 0};
+        index->slots.assign(old.empty() ? 64 : 2 * old.size(), empty);
+        index->generation = 1;
+        for (const auto& slot : old) {
+            if (slot.generation == old_generation) *find_slot(index, slot.measure_num) = {slot.measure_num, slot.row, 1};
+        }
+    }
+
+    index_slot* slot = find_slot(index, measure_num);
+    if (slot->generation != index->generation) {
+        *slot = {measure_num, (uint32_t) new_row, index->generation};
+        index->used++;
+    }
+    return slot->row;
+}
+
+/**
+ * Files the measure just read for the current part under its number in the measure table.
+ */
+void close_measure(parse_state* ps) {
+    parse_context* ctx = ps->ctx;
+    measure& measure_obj = ps->measure_obj;
+    chord& notes = ps->notes;
+
+    // Add the measure to its row of the measure table. A row that has been streamed out already takes no more.
+    size_t row = index_row(&ctx->measure_index, measure_obj.measure_num, ctx->measure_table.size());
+    if (row == ctx->measure_table.size()) {
+        measure_row fresh = {NO_MEASURE, measure_obj.measure_num, false};
+        ctx->measure_table.push_back(fresh);
+    }
+    if (!ps->stream || row >= ps->next_row) {
+        filed_measure filed = {measure_obj, ctx->measure_table[row].newest};
+        ctx->measure_table[row].newest = (uint32_t) ctx->filed_measures.size();
+        ctx->filed_measures.push_back(filed);
+    }
+    ps->last_row = row;
+    if (ps->div_count) ctx->measure_table[row].ragged = true;
+
+    // A beat left unfinished at the end of the measure is dropped.
+    ctx->parsed.notes.resize(notes.offset);
+    notes.count = 0;
+    measure_obj.offset = (uint32_t) ctx->parsed.chords.size();
+    measure_obj.count = 0;
+}
+
+/**
+ * Works out which part an opening <part> belongs to. A partwise score has one <part> per part, in order.
+ */
+int16_t part_index(parse_state* ps, const xml_event* ev) {
+    ps->new_part = true;
+    if (!ps->timewise) return (int16_t) (ps->part + 1);
+
+    str_view id = {NULL, 0};
+    for (auto& attr : ev->attributes) {
+        if (view_equals(attr.name, S_ID)) id = attr.value;
+    }
+    for (size_t i = 0; i < ps->part_ids.size(); i++) {
+        if (ps->part_ids[i].len == id.len && memcmp(ps->part_ids[i].data, id.data, id.len) == 0) {
+            ps->new_part = false;
+            return (int16_t) i;
+        }
+    }
+    ps->part_ids.push_back(id);
+    ps->part_div_counts.push_back(0);
+    return (int16_t) (ps->part_ids.size() - 1);
+}
+
+void select_all(selection* sel) {
+    sel->parts.clear();
+    sel->first_measure = 0;
+    sel->last_measure = UINT32_MAX;
+}
+
+bool selects_all(const selection* sel) {
+    return sel->parts.empty() && sel->first_measure == 0 && sel->last_measure == UINT32_MAX;
+}
+
+// The number a <measure> tag gives its measure: its number attribute, or else that of the one before.
+static uint32_t measure_number(const xml_event* ev, uint32_t previous) {
+    int32_t value;
+    for (auto& attr : ev->attributes) {
+        if (view_equals(attr.name, S_NUMBER) && parse_int(attr.value, &value)) return (uint32_t) value;
+    }
+    return previous;
+}
+
+void init_index_builder(index_builder* b, file_index* index, const input_buffer* input) {
+    b->index = index;
+    b->doc = input->data;
+    b->open.clear();
+    b->timewise = false;
+    b->number = 0;
+    index->input_size = input->size;
+    index->spans.clear();
+}
+
+// Adds what the event just read (which ends at pos) tells of the document's <part> and <measure> elements.
+void index_event(index_builder* b, const xml_event* ev, const char* pos) {
+    if (ev->type == XML_OPEN && ev->id == T_SCORE_TIMEWISE) b->timewise = true;
+    if (ev->type == XML_TEXT || (ev->id != T_PART && ev->id != T_MEASURE)) return;
+
+    std::vector<element_span>& spans = b->index->spans;
+    if (ev->type == XML_OPEN) {
+        if (ev->id == T_MEASURE) b->number = measure_number(ev, b->number);
+        element_span span = {(uint64_t) (ev->tag.data - 1 - b->doc), b->index->input_size, b->number, ev->id == T_PART};
+        b->open.push_back(spans.size());
+        spans.push_back(span);
+    } else {
+        if (!b->open.empty() && spans[b->open.back()].is_part == (ev->id == T_PART)) {
+            spans[b->open.back()].end = (uint64_t) (pos - b->doc);
+            b->open.pop_back();
+        }
+        // Like note_parse, a partwise score numbers each part's measures afresh.
+        if (ev->id == T_PART && !b->timewise) b->number = 0;
+    }
+}
+
+static bool measure_selected(const selection* sel, uint32_t number) {
+    return number >= sel->first_measure && number <= sel->last_measure;
+}
+
+/**
+ * Whether ctx->select keeps the <part> or <measure> just opened. A part's index has already been worked out.
+ */
+bool selected(const parse_state* ps, const xml_event* ev) {
+    const selection* sel = &ps->ctx->select;
+    if (ev->id == T_PART) return sel->parts.empty() || ((size_t) ps->part < sel->parts.size() && sel->parts[ps->part]);
+    return measure_selected(sel, measure_number(ev, ps->measure_obj.measure_num));
+}
+
+// Whether a part that could be read next has not had its <attributes> yet: in a partwise score the current
+// part, in a timewise one any part of the <part-list>.
+static bool attributes_missing(const parse_state* ps) {
+    if (!ps->timewise) return ps->part < 0 || !ps->params_set[ps->part];
+    if (ps->params_set.empty() || ps->params_set.size() < ps->part_count) return true;
+    for (size_t i = 0; i < ps->params_set.size(); i++) {
+        if (!ps->params_set[i]) return true;
+    }
+    return false;
+}
+
+// The entry of the index for the element whose tag starts at p, if there is one.
+static const element_span* find_span(parse_state* ps, const char* p) {
+    if (!ps->index) return NULL;
+    uint64_t offset = (uint64_t) (p - ps->doc);
+    const std::vector<element_span>& spans = ps->index->spans;
+    while (ps->span < spans.size() && spans[ps->span].start < offset) ps->span++;
+    return (ps->span < spans.size() && spans[ps->span].start == offset) ? &spans[ps->span] : NULL;
+}
+
+/**
+ * Jumps over the <part> or <measure> just opened, which ctx->select leaves out. Only while some part still
+ * lacks its <attributes> is the element read, and then only by init_parse, since the parts kept take their
+ * divisions, key and meter from it. A part left out still gets its place.
+ * With an index, any measures right after this one that are left out too are jumped over with it.
+ */
+void skip_unselected(parse_state* ps, xml_tokenizer* tk, xml_event* ev) {
+    if (ev->id == T_PART) {
+        init_parse(ps, ev);
+        note_parse(ps, ev);
+    } else {
+        ps->measure_obj.measure_num = measure_number(ev, ps->measure_obj.measure_num);
+    }
+
+    const char* open = ev->tag.data - 1;
+    tag_id id = ev->id;
+    str_view name = ev->tag;
+    const char* end;
+    if (tk->pending_close) {
+        tk->pending_close = false;
+        end = tk->pos;
+    } else {
+        const element_span* span = find_span(ps, open);
+        if (span && ps->doc + span->end < tk->pos) span = NULL;
+        end = span ? ps->doc + span->end : NULL;
+
+        if (attributes_missing(ps)) {
+            xml_tokenizer inner = *tk;
+            inner.end = end ? end : tk->end;
+            int depth = 0;
+            while (attributes_missing(ps) && next_event(&inner, ev)) {
+                if (ev->type == XML_OPEN && ev->id == id) depth++;
+                if (ev->type == XML_CLOSE && ev->id == id && depth-- == 0) break;
+                if (ev->type == XML_OPEN && ev->id == T_PART) ps->part = part_index(ps, ev);
+                init_parse(ps, ev);
+            }
+            if (!end && ev->type == XML_CLOSE && ev->id == id && depth < 0) end = inner.pos;
+            if (!end) tk->pos = inner.pos;
+        }
+        if (!end) end = skip_element(tk->pos, tk->end, name.data, name.len);
+
+        // Measures left out one after another go in one jump.
+        while (span && id == T_MEASURE && !attributes_missing(ps)) {
+            const std::vector<element_span>& spans = ps->index->spans;
+            size_t next = (size_t) (span - spans.data()) + 1;
+            while (next < spans.size() && spans[next].start < span->end) next++;
+            if (next == spans.size() || spans[next].is_part || measure_selected(&ps->ctx->select, spans[next].number)) break;
+            span = &spans[next];
+            end = ps->doc + span->end;
+            ps->measure_obj.measure_num = span->number;
+        }
+    }
+    tk->pos = end;
+
+    // The close of a timewise part would file its (empty) measure, so only a partwise one is passed on.
+    if (id == T_PART) {
+        ev->type = XML_CLOSE;
+        ev->id = T_PART;
+        ev->attributes.clear();
+        init_parse(ps, ev);
+        if (!ps->timewise) note_parse(ps, ev);
+    }
+}
+
+// Whether no part has any beats in the row.
+bool row_empty(const parse_context* ctx, size_t row) {
+    for (uint32_t i = ctx->measure_table[row].newest; i != NO_MEASURE; i = ctx->filed_measures[i].older) {
+        if (ctx->filed_measures[i].span.count) return false;
+    }
+    return true;
+}
+
+/**
+ * Writes out, in table order, every row every part has delivered. A measure without beats is held back until
+ * another one follows it, since only the final measure is written when empty. Once the document is over
+ * (final), whatever is left is written the same way merge_measures would.
+ */
+void flush_rows(parse_state* ps, bool final) {
+    parse_context* ctx = ps->ctx;
+    render_state* rs = ps->stream;
+    if (ctx->part_params.empty()) return;
+
+    while (ps->next_row < ctx->measure_table.size() && (final || ps->row_done[ps->next_row])) {
+        size_t row = ps->next_row;
+        bool last = row + 1 == ctx->measure_table.size();
+
+        bool empty = row_empty(ctx, row);
+        if (empty && last && !final) break;
+
+        if (!ps->started) {
+            ps->max_duration = max_division(ctx);
+            ctx->piece.params = ctx->part_params;
+            for (auto& param : ctx->piece.params) param.division_count = ps->max_duration;
+            rs->piece = view_score(&ctx->piece);
+            display_part(rs, ctx->piece.params[0]);
+            ps->started = true;
+        }
+
+        if (!empty || last) {
+            merge_row(ctx, row, ps->max_duration, ctx->work, &ctx->piece, &ctx->stats);
+            STAT_TIMER(timer, rs->opts->stats ? &rs->opts->stats->render_ns : NULL);
+            rs->piece = view_score(&ctx->piece);
+            display_measure(rs, ctx->piece.measures.back());
+            ctx->piece.notes.clear();
+            ctx->piece.chords.clear();
+            ctx->piece.measures.clear();
+            ps->written++;
+            if (rs->opts->stats) STAT_ADD(rs->opts->stats, measures, 1);
+        }
+
+        ps->next_row++;
+    }
+
+    if (final && ps->written == 0) {
+        if (!ps->started) {
+            ctx->piece.params = ctx->part_params;
+            display_part(rs, ctx->piece.params[0]);
+        }
+        rs->piece = view_score(&ctx->piece);
+        measure empty;
+        empty.offset = 0;
+        empty.count = 0;
+        empty.measure_num = 0;
+        display_measure(rs, empty);
+        if (rs->opts->stats) STAT_ADD(rs->opts->stats, measures, 1);
+    }
+
+    // Whatever was finished goes out now rather than when the buffer fills.
+    out_flush(rs->out);
+}
+
+/**
+ * Marks a row as delivered by every part and writes out what that finishes. When nothing is left unwritten,
+ * the parsed arrays are emptied, so a timewise score is held one measure at a time.
+ */
+void finish_row(parse_state* ps, size_t row) {
+    parse_context* ctx = ps->ctx;
+    if (ps->row_done.size() < ctx->measure_table.size()) ps->row_done.resize(ctx->measure_table.size(), false);
+    ps->row_done[row] = true;
+    flush_rows(ps, false);
+
+    if (ps->next_row == ctx->measure_table.size()) {
+        STAT_ADD(&ctx->stats, chords, ctx->parsed.chords.size());
+        clear_beats(ctx->parsed);
+        ctx->filed_measures.clear();
+        ps->notes.offset = 0;
+        ps->notes.count = 0;
+        ps->measure_obj.offset = 0;
+        ps->measure_obj.count = 0;
+    }
+}
+
+/**
+ * Handles the <part>, <measure> and <note> events, grouping notes into beats and measures into measure_table.
+ */
+void note_parse(parse_state* ps, const xml_event* ev) {
+    parse_context* ctx = ps->ctx;
+    note& note_obj = ps->note_obj;
+    chord& notes = ps->notes;
+    measure& measure_obj = ps->measure_obj;
+    int32_t value;
+
+    if (ev->type == XML_TEXT) {
+        switch (ps->state) {
+            case DURATION:
+                if (parse_int(ev->text, &value)) note_obj.duration = (uint8_t) value;
+                break;
+            case ALTER:
+                if (parse_int(ev->text, &value)) note_obj.alter = (int8_t) value;
+                break;
+            case OCTAVE:
+                if (parse_int(ev->text, &value)) note_obj.octave = (uint8_t) value;
+                break;
+            case STEP:
+                note_obj.pitch = ev->text.data[0];
+                break;
+            case VOICE:
+                if (parse_int(ev->text, &value)) note_obj.voice = (uint8_t) value;
+                break;
+            default:
+                return;
+        }
+
+        ps->state = PITCH;
+        return;
+    }
+
+    if (ev->type == XML_OPEN) {
+        switch (ev->id) {
+            case T_NOTE:
+                ps->state = NOTE;
+                break;
+            case T_PITCH:
+                ps->state = PITCH;
+                break;
+            case T_DURATION:
+                if (ps->state == PITCH) ps->state = DURATION;
+                break;
+            case T_OCTAVE:
+                if (ps->state == PITCH) ps->state = OCTAVE;
+                break;
+            case T_STEP:
+                if (ps->state == PITCH) ps->state = STEP;
+                break;
+            case T_ALTER:
+                if (ps->state == PITCH) ps->state = ALTER;
+                break;
+            case T_VOICE:
+                ps->state = VOICE;
+                break;
+            case T_REST:
+                ps->state = PITCH;
+                note_obj.pitch = 'R';
+                note_obj.octave = 0;
+                break;
+            case T_MEASURE:
+                for (auto& attr : ev->attributes) {
+                    if (view_equals(attr.name, S_NUMBER) && parse_int(attr.value, &value)) {
+                        measure_obj.measure_num = (uint32_t) value;
+                    }
+                }
+                ps->state = MEASURE;
+                break;
+            case T_PART:
+                note_obj.part = (uint8_t) ps->part;
+                if (ps->timewise) ps->div_count = ps->part_div_counts[ps->part];
+                ps->state = MEASURE;
+                break;
+            case T_SCORE_PART:
+                ps->part_count++;
+                break;
+            case T_SCORE_TIMEWISE:
+                ps->timewise = true;
+                break;
+            default:
+                break;
+        }
+        return;
+    }
+
+    if (ev->id == T_NOTE) {
+        // Add note object to the note group
+        ps->div_count += note_obj.duration;
+        ps->note_count++;
+
+        notes.part = note_obj.part;
+        notes.count++;
+        ctx->parsed.notes.push_back(note_obj);
+
+        if (ps->div_count >= ctx->part_params[note_obj.part].division_count) {
+            notes.duration = ps->div_count;
+            ctx->parsed.chords.push_back(notes);
+            measure_obj.count++;
+
+            notes.offset = (uint32_t) ctx->parsed.notes.size();
+            notes.count = 0;
+            ps->div_count %= ctx->part_params[note_obj.part].division_count;
+        }
+
+        // Reset note_obj.
+        note_obj.alter = INT8_MIN;
+        ps->state = NOTE;
+    } else if (ev->id == T_MEASURE) {
+        if (ps->timewise) {
+            // Every part has been through this measure.
+            if (ps->stream && !ctx->measure_table.empty()) finish_row(ps, ps->last_row);
+        } else {
+            close_measure(ps);
+            // The last part finishes each row it reaches.
+            if (ps->stream && ps->part_count && ps->part + 1 == (int16_t) ps->part_count) finish_row(ps, ps->last_row);
+        }
+        ps->state = MEASURE;
+    } else if (ev->id == T_PART) {
+        if (ps->timewise) {
+            close_measure(ps);
+            ps->part_div_counts[ps->part] = ps->div_count;
+            ps->state = MEASURE;
+        } else {
+            ps->state = PART;
+            ps->div_count = 0;
+            measure_obj.measure_num = 0;
+        }
+        note_obj.alter = INT8_MIN;
+    }
+}
+
+void init_context(parse_context* ctx) {
+    ctx->measure_index.generation = 0;
+    ctx->merge_threads = 1;
+    select_all(&ctx->select);
+    ctx->index = NULL;
+    ctx->record = NULL;
+    reset_context(ctx);
+    clear_stats(&ctx->stats);
+}
+
+void clear_stats(conv_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+void add_stats(conv_stats* total, const conv_stats* stats) {
+    total->files += stats->files;
+    total->bytes += stats->bytes;
+    total->tags += stats->tags;
+    total->notes += stats->notes;
+    total->chords += stats->chords;
+    total->measures += stats->measures;
+    total->repeated += stats->repeated;
+    total->merges += stats->merges;
+    total->allocations += stats->allocations;
+    total->cache_hits += stats->cache_hits;
+    total->spliced += stats->spliced;
+    total->read_ns += stats->read_ns;
+    total->parse_ns += stats->parse_ns;
+    total->handle_dots_ns += stats->handle_dots_ns;
+    total->merge_beats_ns += stats->merge_beats_ns;
+    total->merge_ns += stats->merge_ns;
+    total->render_ns += stats->render_ns;
+}
+
+/**
+ * Formats stats as one line of JSON, naming file if it is not NULL. Times are in milliseconds.
+ */
+std::string stats_json(const conv_stats* stats, const char* file) {
+    std::string json = "{";
+    if (file) {
+        json += "\"file\":\"";
+        for (const char* c = file; *c; c++) {
+            if (*c == '"' || *c == '\\') json += '\\';
+            json += *c;
+        }
+        json += "\",";
+    }
+
+    char line[512];
+    snprintf(line, sizeof(line),
+             "\"files\":%llu,\"cache_hits\":%llu,\"spliced\":%llu,\"bytes\":%llu,\"tags\":%llu,\"notes\":%llu,\"chords\":%llu,\"measures\":%llu,\"repeated\":%llu,\"merges\":%llu,",
+             (unsigned long long) stats->files, (unsigned long long) stats->cache_hits, (unsigned long long) stats->spliced,
+             (unsigned long long) stats->bytes,
+             (unsigned long long) stats->tags, (unsigned long long) stats->notes, (unsigned long long) stats->chords,
+             (unsigned long long) stats->measures, (unsigned long long) stats->repeated, (unsigned long long) stats->merges);
+    json += line;
+#ifdef MP_COUNT_ALLOCS
+    snprintf(line, sizeof(line), "\"allocations\":%llu,", (unsigned long long) stats->allocations);
+    json += line;
+#endif
+    snprintf(line, sizeof(line),
+             "\"ms\":{\"read\":%.3f,\"parse\":%.3f,\"handle_dots\":%.3f,\"merge_beats\":%.3f,\"merge\":%.3f,\"render\":%.3f}}",
+             stats->read_ns / 1e6, stats->parse_ns / 1e6, stats->handle_dots_ns / 1e6, stats->merge_beats_ns / 1e6,
+             stats->merge_ns / 1e6, stats->render_ns / 1e6);
+    json += line;
+    return json;
+}
+
+/**
+ * Forgets the previous document but keeps every buffer's capacity.
+ */
+void reset_context(parse_context* ctx) {
+    ctx->part_params.clear();
+    clear_beats(ctx->parsed);
+    ctx->filed_measures.clear();
+    ctx->measure_table.clear();
+    clear_index(&ctx->measure_index);
+    ctx->piece.notes.clear();
+    ctx->piece.chords.clear();
+    ctx->piece.measures.clear();
+    ctx->piece.params.clear();
+}
+
+/**
+ * Sets up ps to parse a new document into ctx, which is cleared.
+ */
+void init_parse_state(parse_state* ps, parse_context* ctx, render_state* stream) {
+    ps->ctx = ctx;
+    ps->part = -1;
+    reset_context(ctx);
+
+    // Defaults
+    ps->init = TAG;
+    ps->params.beats = 4;
+    ps->params.beat_type = 4;
+    ps->params.division_count = 1;
+    ps->params.key_center = 0;
+    ps->params.major = true;
+
+    ps->state = PART;
+    ps->measure_obj.offset = 0;
+    ps->measure_obj.count = 0;
+    ps->measure_obj.measure_num = 0;
+    ps->notes.offset = 0;
+    ps->notes.count = 0;
+    ps->notes.duration = 0;
+    ps->notes.part = 0;
+    ps->note_obj.alter = INT8_MIN;
+    ps->note_obj.part = 0;
+    ps->note_obj.octave = 0;
+    ps->div_count = 0;
+    ps->note_count = 0;
+
+    ps->timewise = false;
+    ps->new_part = false;
+    ps->last_row = 0;
+    ps->stream = stream;
+    ps->part_count = 0;
+    ps->next_row = 0;
+    ps->max_duration = 1;
+    ps->started = false;
+    ps->written = 0;
+
+    ps->params_set.swap(ctx->scratch.params_set);
+    ps->part_ids.swap(ctx->scratch.part_ids);
+    ps->part_div_counts.swap(ctx->scratch.part_div_counts);
+    ps->row_done.swap(ctx->scratch.row_done);
+    ps->params_set.clear();
+    ps->part_ids.clear();
+    ps->part_div_counts.clear();
+    ps->row_done.clear();
+}
+
+// Hands the parse's bookkeeping back to its context for the next document.
+void release_parse_state(parse_state* ps) {
+    parse_scratch& scratch = ps->ctx->scratch;
+    ps->params_set.swap(scratch.params_set);
+    ps->part_ids.swap(scratch.part_ids);
+    ps->part_div_counts.swap(scratch.part_div_counts);
+    ps->row_done.swap(scratch.row_done);
+}
+
+/**
+ * Parses the whole score in a single pass over the input, feeding every event to both init_parse and note_parse.
+ * With a stream, each measure is merged and written out as soon as all parts have delivered it.
+ */
+int parse_document(parse_context* ctx, const input_buffer* input, render_state* stream) {
+    STAT_TIMER(timer, &ctx->stats.parse_ns);
+    parse_state ps;
+    init_parse_state(&ps, ctx, stream);
+    ps.doc = input->data;
+    ps.index = (ctx->index && ctx->index->input_size == input->size) ? ctx->index : NULL;
+    ps.span = 0;
+    index_builder record;
+    bool recording = ctx->record && selects_all(&ctx->select);
+    if (recording) init_index_builder(&record, ctx->record, input);
+
+    xml_tokenizer tk;
+    init_tokenizer(&tk, input);
+
+    xml_event ev;
+    ev.attributes.swap(ctx->scratch.attributes);
+#ifdef MP_COUNT_ALLOCS
+    size_t tokenizer_allocs = 0;
+    size_t parse_allocs = alloc_count;
+    for (;;) {
+        size_t before = alloc_count;
+        bool more = next_event(&tk, &ev);
+        tokenizer_allocs += alloc_count - before;
+        if (!more) break;
+#else
+    while (next_event(&tk, &ev)) {
+#endif
+        if (recording) index_event(&record, &ev, tk.pos);
+        if (ev.type == XML_OPEN) {
+            STAT_ADD(&ctx->stats, tags, 1);
+            if (ev.id == T_PART) ps.part = part_index(&ps, &ev);
+            if ((ev.id == T_PART || ev.id == T_MEASURE) && !selected(&ps, &ev)) {
+                skip_unselected(&ps, &tk, &ev);
+                continue;
+            }
+        }
+
+        init_parse(&ps, &ev);
+        note_parse(&ps, &ev);
+    }
+
+#ifdef MP_COUNT_ALLOCS
+    parse_allocs = alloc_count - parse_allocs;
+    STAT_ADD(&ctx->stats, allocations, parse_allocs);
+    fprintf(stderr, "notes: %zu, tokenizer allocations: %zu (%.3f per note), parse allocations: %zu (%.3f per note)\n",
+            ps.note_count, tokenizer_allocs, (double) tokenizer_allocs / (ps.note_count ? ps.note_count : 1),
+            parse_allocs, (double) parse_allocs / (ps.note_count ? ps.note_count : 1));
+#endif
+
+    STAT_ADD(&ctx->stats, files, 1);
+    STAT_ADD(&ctx->stats, bytes, input->size);
+    STAT_ADD(&ctx->stats, notes, ps.note_count);
+    STAT_ADD(&ctx->stats, chords, ctx->parsed.chords.size());
+
+    if (stream) flush_rows(&ps, true);
+    release_parse_state(&ps);
+    ev.attributes.swap(ctx->scratch.attributes);
+    return ctx->part_params.empty();
+}
+
+int parse(parse_context* ctx, const input_buffer* input) {
+    return parse_document(ctx, input, NULL);
+}
+
+// Whether the tag just before the one at tag (whitespace aside) is a <part> start tag.
+static bool follows_part(const char* doc, const char* tag) {
+    const char* p = tag;
+    while (p > doc && isspace((unsigned char) p[-1])) p--;
+    if (p == doc || p[-1] != '>') return false;
+    while (p > doc && *p != '<') p--;
+    return strncmp(p, "<part", 5) == 0 && (p[5] == '>' || isspace((unsigned char) p[5]));
+}
+
+/**
+ * Whether a part may give one of its measures the number of an earlier one (an implicit measure with no
+ * number of its own, say), which would add to a row parse_stream has already written. Only <measure> start tags
+ * are read, a part being taken to start at one that directly follows <part>. Numbers that merely go down count
+ * too, so the answer can be yes when no row is shared but never no when one is.
+ */
+static bool numbers_repeat(const input_buffer* input) {
+    const scan_ops* ops = scanner();
+    const char* p = input->data;
+    const char* end = input->data + input->size;
+    int64_t last = INT64_MIN; // Number of the part's previous measure.
+
+    while ((p = ops->find_pair(p, end, '<', 'm')) < end) {
+        const char* tag = p;
+        const char* name_end = ops->find_name_end(p + 1, end);
+        p = name_end;
+        if (name_end - tag != 8 || memcmp(tag, "<measure", 8) != 0) continue;
+
+        bool first = last == INT64_MIN || follows_part(input->data, tag);
+        const char* close = ops->find_char(name_end, end, '>');
+        int32_t value = first ? 0 : (int32_t) last;
+        for (const char* a = name_end; a + 6 < close; a++) {
+            if (memcmp(a, "number", 6) != 0 || !isspace((unsigned char) a[-1])) continue;
+            const char* q = a + 6;
+            while (q < close && isspace((unsigned char) *q)) q++;
+            if (q == close || *q++ != '=') continue;
+            while (q < close && isspace((unsigned char) *q)) q++;
+            if (q == close || (*q != '"' && *q != '\'')) continue;
+            const char* value_end = ops->find_char(q + 1, close, *q);
+            str_view text = {q + 1, (size_t) (value_end - q - 1)};
+            parse_int(text, &value);
+            break;
+        }
+        if (!first && value <= last) return true;
+        last = value;
+        p = close;
+    }
+    return false;
+}
+
+/**
+ * Parses input and writes each measure to out as soon as every part has delivered it, instead of holding the
+ * whole piece. The measures come out exactly as parse, merge_measures and display would write them; a score
+ * whose parts reuse measure numbers is converted that way, whole. Returns nonzero (having written nothing) if
+ * the document holds no parts.
+ */
+int parse_stream(parse_context* ctx, const input_buffer* input, const render_options* opts, FILE* out) {
+    if (numbers_repeat(input)) {
+        if (parse(ctx, input) != 0) return 1;
+        merge_measures(ctx);
+        return display(&ctx->piece, opts, out);
+    }
+
+    out_buffer ob;
+    ob.sink = out;
+    ob.failed = false;
+    ob.data.reserve(OUT_CHUNK + OUT_CHUNK / 4);
+
+    repeat_table repeats;
+    repeats.written = 0;
+    render_state rs;
+    rs.piece = view_score(&ctx->piece);
+    rs.opts = opts;
+    rs.out = &ob;
+    rs.repeats = opts->repeats ? &repeats : NULL;
+
+    if (parse_document(ctx, input, &rs) != 0) return 1;
+    if (opts->tokens) {
+        out_token(&ob, TOK_EOS);
+        out_flush(&ob);
+    }
+    return (ob.failed || ferror(out)) ? 1 : 0;
+}
+
+void out_flush(out_buffer* ob) {
+    if (ob->sink == NULL || ob->data.empty()) return;
+    if (fwrite(ob->data.data(), 1, ob->data.size(), ob->sink) != ob->data.size()) ob->failed = true;
+    ob->data.clear();
+}
+
+inline void out_char(out_buffer* ob, char c) {
+    ob->data.push_back(c);
+}
+
+inline void out_str(out_buffer* ob, const char* s, size_t len) {
+    ob->data.append(s, len);
+}
+
+/**
+ * Writes v in decimal, the way printf("%d") would.
+ */
+inline void out_int(out_buffer* ob, int32_t v) {
+    char digits[11];
+    char* p = digits + sizeof(digits);
+    uint32_t u = v < 0 ? 0u - (uint32_t) v : (uint32_t) v;
+    do {
+        *--p = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) *--p = '-';
+    ob->data.append(p, digits + sizeof(digits) - p);
+}
+
+inline void out_accidental(out_buffer* ob, int8_t alter) {
+    if (alter >= -2 && alter <= 2) out_str(ob, accidental_names[alter + 2], accidental_lengths[alter + 2]);
+}
+
+inline void out_token(out_buffer* ob, uint16_t id) {
+    ob->data.push_back((char) (uint8_t) id);
+}
+
+/**
+ * The vocabulary entry for a token: what it stands for in the text output, or a <tag> for the markers.
+ */
+std::string token_name(uint16_t id) {
+    static const char* const marks[TOK_PITCH] = {"<pad>", "<bos>", "<eos>", "|", "[", "]", "(", ")", ",", "R"};
+    if (id < TOK_PITCH) return marks[id];
+    if (id < TOK_OCTAVE) {
+        std::string name(1, "CDEFGAB"[(id - TOK_PITCH) / 6]);
+        int alter = (id - TOK_PITCH) % 6;
+        if (alter > 0) name += accidental_names[alter - 1];
+        return name;
+    }
+    if (id < TOK_DURATION) return "oct=" + std::to_string(id - TOK_OCTAVE);
+    if (id < TOK_BEATS) return "dur=" + std::to_string(id - TOK_DURATION + 1);
+    if (id < TOK_BEAT_TYPE) return "beats=" + std::to_string(id - TOK_BEATS + 1);
+    if (id < TOK_KEY) return "beat-type=" + std::to_string(1 << (id - TOK_BEAT_TYPE));
+    if (id < TOK_KEY + 30) return std::string("K:") + key_name((int8_t) ((id - TOK_KEY) % 15 - 7), id < TOK_KEY + 15);
+    if (id < TOK_REPEAT) return "K:?";
+    if (id < TOK_COUNT) return "repeat=" + std::to_string(id - TOK_REPEAT + 1);
+    return "";
+}
+
+/**
+ * The header of a .npy file holding count uint8 values, padded to 64 bytes like numpy's own.
+ */
+std::string npy_header(size_t count) {
+    std::string dict = "{'descr': '|u1', 'fortran_order': False, 'shape': (" + std::to_string(count) + ",), }";
+    size_t total = 10 + dict.size() + 1;
+    dict.append((64 - total % 64) % 64, ' ');
+    dict += '\n';
+
+    std::string header = "\x93NUMPY";
+    header += (char) 1;
+    header += (char) 0;
+    header += (char) (dict.size() & 0xff);
+    header += (char) (dict.size() >> 8);
+    return header + dict;
+}
+
+// Reads the n of an "Mn" at p, returning what follows it, or NULL if there is none.
+static const char* read_measure_num(const char* p, const char* end, int32_t* num) {
+    if (p == end || *p != 'M') return NULL;
+    p++;
+    bool negative = p < end && *p == '-';
+    if (negative) p++;
+    const char* digits = p;
+    int64_t n = 0;
+    while (p < end && *p >= '0' && *p <= '9' && p - digits < 10) n = n * 10 + (*p++ - '0');
+    if (p == digits) return NULL;
+    *num = (int32_t) (negative ? -n : n);
+    return p;
+}
+
+/**
+ * Undoes render_options.repeats: copies a rendering (text, or tokens without their .npy header) into text with
+ * every reference replaced by the measure it names. Returns nonzero if one names a measure that is not before it.
+ */
+int expand_repeats(const char* data, size_t size, bool tokens, std::string* text) {
+    text->clear();
+    text->reserve(size + size / 2);
+    if (tokens) {
+        const uint8_t* ids = (const uint8_t*) data;
+        std::vector<std::pair<size_t, size_t>> measures; // Where each measure went in text, its | included.
+        size_t start = 0;
+        for (size_t i = 0; i < size; i++) {
+            uint8_t id = ids[i];
+            if (id >= TOK_REPEAT && id < TOK_COUNT) {
+                size_t back = id - TOK_REPEAT + 1;
+                if (back > measures.size() || i + 1 == size || ids[i + 1] != TOK_BAR) return 1;
+                std::pair<size_t, size_t> was = measures[measures.size() - back];
+                text->append(*text, was.first, was.second);
+                i++;
+            } else {
+                text->push_back((char) id);
+                // The header comes before the first measure.
+                if (id == TOK_BOS || (id >= TOK_BEATS && id < TOK_REPEAT)) start = text->size();
+                if (id != TOK_BAR) continue;
+            }
+            measures.push_back(std::make_pair(start, text->size() - start));
+            start = text->size();
+        }
+        return 0;
+    }
+
+    std::unordered_map<int32_t, std::pair<size_t, size_t>> bodies; // Where each measure went after its "M1: ".
+    const char* end = data + size;
+    for (const char* line = data; line < end;) {
+        const char* eol = (const char*) memchr(line, '\n', end - line);
+        eol = eol ? eol + 1 : end;
+        int32_t num;
+        const char* label = read_measure_num(line, eol, &num);
+        if (!label || eol - label < 2 || label[0] != ':' || label[1] != ' ') {
+            text->append(line, eol - line);
+            line = eol;
+            continue;
+        }
+
+        const char* body = label + 2;
+        text->append(line, body - line);
+        size_t offset = text->size();
+        int32_t target;
+        const char* ref = body < eol && *body == '=' ? read_measure_num(body + 1, eol, &target) : NULL;
+        if (ref && eol - ref >= 2 && memcmp(ref, " |", 2) == 0) {
+            auto found = bodies.find(target);
+            if (found == bodies.end()) return 1;
+            text->append(*text, found->second.first, found->second.second);
+        } else {
+            text->append(body, eol - body);
+        }
+        bodies[num] = std::make_pair(offset, text->size() - offset);
+        line = eol;
+    }
+    return 0;
+}
+
+template <typename Mode>
+inline void out_mark(out_buffer* ob, char c, uint16_t id) {
+    if (Mode::tokens) {
+        out_token(ob, id);
+    } else {
+        out_char(ob, c);
+    }
+}
+
+// C to B as 0 to 6.
+inline int step_index(char pitch) {
+    return step_indices[pitch - 'A'];
+}
+
+uint16_t key_token(const char* key) {
+    for (int fifths = -7; fifths <= 7; fifths++) {
+        if (strcmp(key, key_name((int8_t) fifths, true)) == 0) return (uint16_t) (TOK_KEY + fifths + 7);
+        if (strcmp(key, key_name((int8_t) fifths, false)) == 0) return (uint16_t) (TOK_KEY + 15 + fifths + 7);
+    }
+    return TOK_KEY + 30;
+}
+
+/**
+ * The name of the key with key_center fifths, as written on the K: line ("B♭", "f#"), or "" if there is none.
+ */
+const char* key_name(int8_t key_center, bool major) {
+    if (key_center < -7 || key_center > 7) return "";
+    return (major ? major_names : minor_names)[key_center + 7];
+}
+
+void display_part(render_state* rs, init_params p) {
+    const char* key = rs->opts->key_override ? rs->opts->key_override : key_name(p.key_center, p.major);
+    if (rs->opts->tokens) {
+        int beat_type = 0;
+        while (beat_type < 6 && (1 << beat_type) < p.beat_type) beat_type++;
+        out_token(rs->out, TOK_BOS);
+        out_token(rs->out, (uint16_t) (TOK_BEATS + (p.beats < 1 ? 0 : p.beats > 32 ? 31 : p.beats - 1)));
+        out_token(rs->out, (uint16_t) (TOK_BEAT_TYPE + beat_type));
+        out_token(rs->out, key_token(key));
+        return;
+    }
+    out_str(rs->out, "M: ", 3);
+    out_int(rs->out, p.beats);
+    out_char(rs->out, '/');
+    out_int(rs->out, p.beat_type);
+    out_str(rs->out, "\nK: ", 4);
+    out_str(rs->out, key, strlen(key));
+    out_char(rs->out, '\n');
+}
+
+score_view view_score(const score* piece) {
+    score_view view;
+    view.notes = piece->notes.data();
+    view.note_count = piece->notes.size();
+    view.chords = piece->chords.data();
+    view.chord_count = piece->chords.size();
+    view.measures = piece->measures.data();
+    view.measure_count = piece->measures.size();
+    view.params = piece->params.data();
+    view.part_count = piece->params.size();
+    return view;
+}
+
+void display_score(const score_view* view, const render_options* opts, out_buffer* ob) {
+    STAT_TIMER(timer, opts->stats ? &opts->stats->render_ns : NULL);
+    if (opts->stats) STAT_ADD(opts->stats, measures, view->measure_count);
+    repeat_table repeats;
+    repeats.written = 0;
+    render_state rs;
+    rs.piece = *view;
+    rs.opts = opts;
+    rs.out = ob;
+    rs.repeats = opts->repeats ? &repeats : NULL;
+
+    // Displaying the initial parameters.
+    display_part(&rs, view->params[0]);
+
+    // Displaying the measures themselves
+    for (const measure* m = view->measures; m < view->measures + view->measure_count; m++) {
+        display_measure(&rs, *m);
+    }
+    if (opts->tokens) out_token(ob, TOK_EOS);
+}
+
+/**
+ * Writes a score to out in inline notation, a chunk at a time. Tokens are written as a .npy file, which
+ * needs their count up front, so they are held until the end.
+ */
+int display_view(const score_view* view, const render_options* opts, FILE* out) {
+    out_buffer ob;
+    ob.sink = opts->tokens ? NULL : out;
+    ob.failed = false;
+    ob.data.reserve(OUT_CHUNK + OUT_CHUNK / 4);
+
+    display_score(view, opts, &ob);
+    if (opts->tokens) {
+        std::string header = npy_header(ob.data.size());
+        if (fwrite(header.data(), 1, header.size(), out) != header.size()) ob.failed = true;
+        ob.sink = out;
+    }
+    out_flush(&ob);
+    return (ob.failed || ferror(out)) ? 1 : 0;
+}
+
+/**
+ * Renders a score into text (replacing its contents, but reusing its capacity) instead of a stream. Tokens
+ * come out as the bare array, without a .npy header.
+ */
+int render_view(const score_view* view, const render_options* opts, std::string* text) {
+    out_buffer ob;
+    ob.sink = NULL;
+    ob.failed = false;
+    ob.data.swap(*text);
+    ob.data.clear();
+
+    display_score(view, opts, &ob);
+    ob.data.swap(*text);
+    return 0;
+}
+
+int display(const score* piece, const render_options* opts, FILE* out) {
+    score_view view = view_score(piece);
+    return display_view(&view, opts, out);
+}
+
+int render(const score* piece, const render_options* opts, std::string* text) {
+    score_view view = view_score(piece);
+    return render_view(&view, opts, text);
+}
+
+template <typename Mode>
+void display_note(out_buffer* ob, note nt) {
+    if (Mode::tokens) {
+        if (nt.pitch < 'A' || nt.pitch > 'G') { // Rests ('R') and anything else that is not a pitch.
+            if (!Mode::ml) out_token(ob, TOK_REST);
+            return;
+        }
+        int alter = nt.alter >= -2 && nt.alter <= 2 ? nt.alter + 3 : 0;
+        out_token(ob, (uint16_t) (TOK_PITCH + (step_index(nt.pitch) * 6) + alter));
+        if (!Mode::ml) out_token(ob, (uint16_t) (TOK_OCTAVE + (nt.octave > 9 ? 9 : nt.octave)));
+        return;
+    }
+    if (Mode::ml && nt.pitch == 'R') return; // Tokenization form.
+
+    out_char(ob, nt.pitch);
+    if (nt.alter != INT8_MIN) out_accidental(ob, nt.alter);
+    if (!Mode::ml) { // Display nicely.
+        if (nt.octave < 10) out_char(ob, (char) ('0' + nt.octave));
+        else out_int(ob, nt.octave);
+    }
+}
+
+/**
+ * Displays the voices [begin, end) of a chord lasting duration, in a beat of division. Subdivisions are displayed
+ * recursively on sub-spans of the same note array.
+ */
+template <typename Mode>
+void display_chord(out_buffer* ob, const note* begin, const note* end, uint16_t duration, uint8_t division) {
+    uint8_t subdiv_count = 0;
+    for (const note* iter = begin; iter < end; iter++) {
+        uint8_t dur = iter->duration;
+        if (dur < duration) {
+            const note* start_pos = iter;
+
+            while (iter < end && (subdiv_count += iter->duration) < duration) {
+                iter++;
+            }
+
+            if (iter != end) {
+                if (dur < division) out_mark<Mode>(ob, '(', TOK_SUB_OPEN);
+                display_chord<Mode>(ob, start_pos, iter + 1, duration / 2, division);
+                if (dur < division) out_mark<Mode>(ob, ')', TOK_SUB_CLOSE);
+                if ((iter + 1) != end
+                    && dur <= (iter + 1)->duration
+                    && (iter + 1)->duration < division / 2) out_mark<Mode>(ob, ',', TOK_SEP);
+            }
+
+            subdiv_count = 0;
+            if (iter == end) break;
+        } else {
+            display_note<Mode>(ob, *iter);
+            if (iter->duration == duration && iter->duration < division && iter != end - 1) out_mark<Mode>(ob, ',', TOK_SEP);
+        }
+    }
+}
+
+/**
+ * Displays the beats of m. Merging gives every part the same division_count, so each beat looks up its own once
+ * and its voices use that.
+ */
+template <typename Mode>
+void display_beats(render_state* rs, const measure& m) {
+    out_buffer* ob = rs->out;
+    if (!Mode::tokens) {
+        out_char(ob, 'M');
+        out_int(ob, (int32_t) m.measure_num);
+        out_str(ob, ": ", 2);
+    }
+    for (const chord* crd = rs->piece.chords + m.offset; crd < rs->piece.chords + m.offset + m.count; crd++) {
+        const note* voices = rs->piece.notes + crd->offset;
+        uint8_t division = rs->piece.params[crd->part].division_count;
+        uint16_t beats = crd->duration / division;
+
+        out_mark<Mode>(ob, '[', TOK_BEAT_OPEN);
+        display_chord<Mode>(ob, voices, voices + crd->count, crd->duration, division);
+        out_mark<Mode>(ob, ']', TOK_BEAT_CLOSE);
+        if (Mode::tokens) {
+            if (crd->duration > division) out_token(ob, (uint16_t) (TOK_DURATION + (beats > 64 ? 64 : beats) - 1));
+        } else {
+            if (crd->duration > division) out_int(ob, beats);
+            out_char(ob, ' ');
+        }
+    }
+    if (Mode::tokens) out_token(ob, TOK_BAR);
+    else out_str(ob, "|\n", 2);
+}
+
+void display_measure(render_state* rs, const measure& m) {
+    if (rs->repeats && display_repeat(rs, m)) return;
+    // The mode is settled here, once a measure; nothing below it tests the options.
+    if (rs->opts->tokens) {
+        if (rs->opts->ml_flag) display_beats<ml_token_mode>(rs, m);
+        else display_beats<token_mode>(rs, m);
+    } else {
+        if (rs->opts->ml_flag) display_beats<ml_text_mode>(rs, m);
+        else display_beats<text_mode>(rs, m);
+    }
+
+    if (rs->out->data.size() >= OUT_CHUNK) out_flush(rs->out);
+}
+
+void clear_beats(beat_list& bl) {
+    bl.notes.clear();
+    bl.chords.clear();
+}
+
+/**
+ * Appends the chords [first, last) to chords, copying their voices out of src_notes and rebasing them onto notes.
+ */
+void append_beats(std::vector<note>& notes, std::vector<chord>& chords, const std::vector<note>& src_notes, const chord* first, const chord* last) {
+    for (const chord* c = first; c < last; c++) {
+        chord copy = *c;
+        copy.offset = (uint32_t) notes.size();
+        notes.insert(notes.end(), src_notes.begin() + c->offset, src_notes.begin() + c->offset + c->count);
+        chords.push_back(copy);
+    }
+}
+
+/**
+ * Inserts the voices [first, last) before voice pos of chord ci. The range must not point into bl.
+ */
+void insert_voices(beat_list& bl, size_t ci, size_t pos, const note* first, const note* last) {
+    size_t n = last - first;
+    bl.notes.insert(bl.notes.begin() + bl.chords[ci].offset + pos, first, last);
+    bl.chords[ci].count += n;
+    for (size_t k = ci + 1; k < bl.chords.size(); k++) bl.chords[k].offset += n;
+}
+
+/**
+ * Inserts a new chord before chord ci (or at the end) with the voices [first, last). The range must not point into bl.
+ */
+void insert_chord(beat_list& bl, size_t ci, uint16_t duration, uint8_t part, const note* first, const note* last) {
+    size_t n = last - first;
+    chord c;
+    c.offset = (uint32_t) ((ci < bl.chords.size()) ? bl.chords[ci].offset : bl.notes.size());
+    c.count = (uint16_t) n;
+    c.duration = duration;
+    c.part = part;
+
+    bl.notes.insert(bl.notes.begin() + c.offset, first, last);
+    bl.chords.insert(bl.chords.begin() + ci, c);
+    for (size_t k = ci + 1; k < bl.chords.size(); k++) bl.chords[k].offset += n;
+}
+
+void handle_dots(const parse_context* ctx, beat_list& m) {
+    uint8_t div_count = 0;
+    for (size_t beat = 0; beat < m.chords.size(); beat++) {
+        uint8_t part_div_c = ctx->part_params[m.chords[beat].part].division_count;
+        for (size_t v = 0; v < m.chords[beat].count; v++) {
+            note* iter = &m.notes[m.chords[beat].offset + v];
+            if ((iter->duration + div_count) > part_div_c && (iter->duration + div_count) % part_div_c != 0) {
+                note copy_note = *iter;
+                copy_note.duration = (uint8_t) (iter->duration + div_count - part_div_c);
+
+                iter->duration = part_div_c - div_count;
+                m.chords[beat].duration = part_div_c;
+                if (copy_note.duration >= part_div_c) {
+                    insert_chord(m, beat + 1, copy_note.duration, m.chords[beat].part, &copy_note, &copy_note + 1);
+                } else if (beat + 1 < m.chords.size()) {
+                    insert_voices(m, beat + 1, 0, &copy_note, &copy_note + 1);
+                } else {
+                    // No next beat to carry into: the remainder goes in front of this one.
+                    insert_voices(m, beat, 0, &copy_note, &copy_note + 1);
+                    v++;
+                }
+            } else if ((iter->duration + div_count) < part_div_c && (iter->duration + div_count) % 2 == 1) {
+                note copy_note = *iter;
+
+                uint16_t n = nearest_bin_power(iter->duration);
+                copy_note.duration = iter->duration - n;
+
+                if (n != 0) {
+                    iter->duration = n;
+                    insert_voices(m, beat, v + 1, &copy_note, &copy_note + 1);
+                }
+            }
+
+            div_count += m.notes[m.chords[beat].offset + v].duration;
+            if (div_count >= part_div_c) div_count %= part_div_c;
+        }
+    }
+}
+
+int compare_notes(const note& n1, const note& n2) {
+    if (n1.octave < n2.octave) {
+        return -1;
+    } else if (n1.octave > n2.octave) {
+        return 1;
+    } else {
+        uint8_t p2 = n2.pitch < 'C' ? n2.pitch + 10 : n2.pitch;
+        if (n1.pitch < p2) {
+            return -1;
+        }
+        return (n1.pitch > p2);
+    }
+}
+
+/**
+ * Adds the voices [first, last) of one run to the beat being merged: below everything so far if first is
+ * not above its lowest voice, above it otherwise. work.front holds the voices added below, last first.
+ */
+void add_voices(merge_work& work, const note* first, const note* last, uint16_t length, uint16_t duration) {
+    if (first == last) return;
+    const note* lowest = work.front.empty() ? (work.back.empty() ? NULL : &work.back.front()) : &work.front.back();
+    bool below = lowest && compare_notes(*lowest, *first) >= 0;
+    std::vector<note>& voices = below ? work.front : work.back;
+    size_t at = voices.size();
+    if (below) {
+        for (const note* nt = last; nt > first; nt--) voices.push_back(*(nt - 1));
+    } else {
+        voices.insert(voices.end(), first, last);
+    }
+
+    // A voice held over the whole of a chord that is being cut up lasts as long as the piece it lands in.
+    if (length == duration) return;
+    for (note* nt = voices.data() + at; nt < voices.data() + voices.size(); nt++) {
+        if (nt->duration == duration) nt->duration = (uint8_t) length;
+    }
+}
+
+/**
+ * Merges the part/voice runs of a measure into work.merged in a single pass. Every run is walked at once
+ * on the common grid of beat boundaries: each beat of the result ends at the nearest end of a run's current
+ * chord, and takes the voices of every run that covers it, in run order. The measure lasts as long as its
+ * first run.
+ */
+void merge_beats(conv_stats* stats, const beat_list& m, merge_work& work) {
+    std::vector<voice_run>& runs = work.runs;
+    runs.clear();
+    clear_beats(work.merged);
+
+    // Split the measure into runs wherever the part or the voice changes.
+    for (size_t i = 0; i < m.chords.size(); i++) {
+        if (i == 0 || m.chords[i].part != m.chords[i - 1].part
+            || m.notes[m.chords[i].offset].voice != m.notes[m.chords[i - 1].offset].voice) {
+            if (!runs.empty()) runs.back().end = i;
+            voice_run run = {i, m.chords.size(), 0};
+            runs.push_back(run);
+        }
+    }
+    STAT_ADD(stats, merges, runs.size());
+
+    uint32_t time = 0;
+    while (!runs.empty() && runs[0].chord < runs[0].end) {
+        // The beat ends where the first of the current chords does.
+        uint32_t beat_end = UINT32_MAX;
+        for (auto& run : runs) {
+            if (run.chord < run.end && run.start + m.chords[run.chord].duration < beat_end) beat_end = run.start + m.chords[run.chord].duration;
+        }
+        uint16_t length = (uint16_t) (beat_end - time);
+
+        work.front.clear();
+        work.back.clear();
+        for (auto& run : runs) {
+            if (run.chord >= run.end) continue;
+            const chord& c = m.chords[run.chord];
+            add_voices(work, m.notes.data() + c.offset, m.notes.data() + c.offset + c.count, length, c.duration);
+        }
+
+        chord merged;
+        merged.offset = (uint32_t) work.merged.notes.size();
+        merged.count = (uint16_t) (work.front.size() + work.back.size());
+        merged.duration = length;
+        merged.part = m.chords[runs[0].chord].part;
+        work.merged.notes.insert(work.merged.notes.end(), work.front.rbegin(), work.front.rend());
+        work.merged.notes.insert(work.merged.notes.end(), work.back.begin(), work.back.end());
+        work.merged.chords.push_back(merged);
+
+        // Step every run whose chord ends here.
+        time = beat_end;
+        for (auto& run : runs) {
+            if (run.chord < run.end && run.start + m.chords[run.chord].duration == beat_end) {
+                run.start = beat_end;
+                run.chord++;
+            }
+        }
+    }
+}
+
+uint8_t max_division(const parse_context* ctx) {
+    uint8_t max_duration = 0;
+    for (auto& param : ctx->part_params) {
+        max_duration = (param.division_count >= max_duration) ? param.division_count : max_duration;
+    }
+    return max_duration;
+}
+
+/**
+ * Merges every part's copy of one row of the measure table into a single measure at the end of out,
+ * with durations scaled up to max_duration divisions per beat. Only reads ctx, so rows can be merged
+ * on several threads at once, each with its own work, out and stats.
+ */
+void merge_row(const parse_context* ctx, size_t row, uint8_t max_duration, merge_work& work, score* out, conv_stats* stats) {
+    // Couple all like measures together. Parts are concatenated last-arrived first,
+    // which is the order merge_beats expects.
+    clear_beats(work.consolidated);
+    for (uint32_t i = ctx->measure_table[row].newest; i != NO_MEASURE; i = ctx->filed_measures[i].older) {
+        const measure& part = ctx->filed_measures[i].span;
+        const chord* first = ctx->parsed.chords.data() + part.offset;
+
+        clear_beats(work.part);
+        append_beats(work.part.notes, work.part.chords, ctx->parsed.notes, first, first + part.count);
+        {
+            STAT_TIMER(timer, &stats->handle_dots_ns);
+            handle_dots(ctx, work.part);
+        }
+        append_beats(work.consolidated.notes, work.consolidated.chords, work.part.notes, work.part.chords.data(), work.part.chords.data() + work.part.chords.size());
+    }
+
+    for (auto& chord : work.consolidated.chords) {
+        uint8_t factor = max_duration / ctx->part_params[chord.part].division_count;
+        for (note* nt = work.consolidated.notes.data() + chord.offset; nt < work.consolidated.notes.data() + chord.offset + chord.count; nt++) {
+            nt->duration *= factor;
+        }
+        chord.duration *= factor;
+    }
+
+    // Merge the beats together.
+    {
+        STAT_TIMER(timer, &stats->merge_beats_ns);
+        merge_beats(stats, work.consolidated, work);
+    }
+
+    measure merged;
+    merged.offset = (uint32_t) out->chords.size();
+    merged.count = (uint32_t) work.merged.chords.size();
+    merged.measure_num = ctx->measure_table[row].measure_num;
+    append_beats(out->notes, out->chords, work.merged.notes, work.merged.chords.data(), work.merged.chords.data() + work.merged.chords.size());
+    out->measures.push_back(merged);
+}
+
+/**
+ * Merges the rows [first, last) of the measure table onto the end of out. Measures left without any beats
+ * are dropped, except for the final one.
+ */
+void merge_rows(const parse_context* ctx, size_t first, size_t last, uint8_t max_duration, merge_work* work, score* out, conv_stats* stats) {
+    for (size_t row = first; row < last; row++) {
+        if (row_empty(ctx, row) && row + 1 != ctx->measure_table.size()) continue;
+        merge_row(ctx, row, max_duration, *work, out, stats);
+    }
+}
+
+// A thread of a parallel merge_measures gets at least this many parsed notes; below that starting it costs more than it saves.
+const size_t MERGE_SHARE_NOTES = 1 << 16;
+
+/**
+ * Merges the measure table on up to ctx->merge_threads threads, each taking an equal run of rows into a
+ * share of its own. The shares are then stitched onto ctx->piece in row order, so the result is the same
+ * whatever the number of threads.
+ */
+void merge_shares(parse_context* ctx, size_t threads, uint8_t max_duration) {
+    size_t rows = ctx->measure_table.size();
+    if (ctx->shares.size() < threads) ctx->shares.resize(threads);
+    for (size_t t = 0; t < threads; t++) {
+        merge_share& share = ctx->shares[t];
+        share.merged.notes.clear();
+        share.merged.chords.clear();
+        share.merged.measures.clear();
+        clear_stats(&share.stats);
+    }
+
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++) {
+        merge_share& share = ctx->shares[t];
+        pool.push_back(std::thread(merge_rows, ctx, rows * t / threads, rows * (t + 1) / threads, max_duration,
+                                   &share.work, &share.merged, &share.stats));
+    }
+    merge_share& own = ctx->shares[0];
+    merge_rows(ctx, 0, rows / threads, max_duration, &own.work, &own.merged, &own.stats);
+    for (auto& t : pool) t.join();
+
+    score& piece = ctx->piece;
+    for (size_t t = 0; t < threads; t++) {
+        const score& merged = ctx->shares[t].merged;
+        uint32_t chord_base = (uint32_t) piece.chords.size();
+        uint32_t note_base = (uint32_t) piece.notes.size();
+        for (measure m : merged.measures) {
+            m.offset += chord_base;
+            piece.measures.push_back(m);
+        }
+        for (chord c : merged.chords) {
+            c.offset += note_base;
+            piece.chords.push_back(c);
+        }
+        piece.notes.insert(piece.notes.end(), merged.notes.begin(), merged.notes.end());
+        add_stats(&ctx->stats, &ctx->shares[t].stats);
+    }
+}
+
+void merge_measures(parse_context* ctx) {
+    STAT_TIMER(timer, &ctx->stats.merge_ns);
+    // Standardizing durations
+    uint8_t max_duration = max_division(ctx);
+
+    ctx->piece.notes.clear();
+    ctx->piece.chords.clear();
+    ctx->piece.measures.clear();
+    ctx->piece.notes.reserve(ctx->parsed.notes.size() + ctx->parsed.notes.size() / 4);
+    ctx->piece.chords.reserve(ctx->parsed.chords.size() + ctx->parsed.chords.size() / 4);
+    ctx->piece.measures.reserve(ctx->measure_table.size());
+
+    size_t threads = std::min<size_t>(ctx->merge_threads, ctx->parsed.notes.size() / MERGE_SHARE_NOTES);
+    threads = std::min(threads, ctx->measure_table.size());
+    if (threads > 1) {
+        merge_shares(ctx, threads, max_duration);
+    } else {
+        merge_rows(ctx, 0, ctx->measure_table.size(), max_duration, &ctx->work, &ctx->piece, &ctx->stats);
+    }
+
+    if (ctx->piece.measures.empty()) {
+        measure empty;
+        empty.offset = 0;
+        empty.count = 0;
+        empty.measure_num = 0;
+        ctx->piece.measures.push_back(empty);
+    }
+
+    for (auto& param : ctx->part_params) {
+        param.division_count = max_duration;
+    }
+    ctx->piece.params = ctx->part_params;
+
+    // The parsed arrays are no longer needed once everything is merged. Their capacity is kept for the
+    // next document parsed with this context.
+    clear_beats(ctx->parsed);
+    ctx->filed_measures.clear();
+    ctx->measure_table.clear();
+    clear_index(&ctx->measure_index);
+}
+
+
+/**
+ * Parses and merges size bytes of MusicXML. Returns NULL if the document holds no parts; otherwise the score
+ * stays valid until the next call with ctx.
+ */
+const score* parse_score(parse_context* ctx, const char* data, size_t size) {
+    input_buffer input;
+    input.data = data;
+    input.size = size;
+    input.mapped = false;
+
+    if (parse(ctx, &input) != 0) return NULL;
+    merge_measures(ctx);
+    return &ctx->piece;
+}
+
+// How one spelled pitch moves under a transposition: its new letter and alter, and the change of octave.
+typedef struct __spelling__ {
+    char pitch;
+    int8_t alter;
+    int8_t octave_shift;
+} spelling;
+
+const int TRANSPOSE_MAX = 14; // Fifths between the furthest key signatures.
+const char step_letters[7] = {'C', 'D', 'E', 'F', 'G', 'A', 'B'};
+const int8_t step_classes[7] = {0, 2, 4, 5, 7, 9, 11};
+const int8_t step_fifths[7] = {0, 2, 4, -1, 1, 3, 5}; // Place on the line of fifths, counted from C.
+
+typedef struct __spellingtables__ {
+    spelling entries[2 * TRANSPOSE_MAX + 1][7][5]; // By fifths moved + TRANSPOSE_MAX, step, then alter + 2.
+} spelling_tables;
+
+/**
+ * Works out, once for every transposition by -TRANSPOSE_MAX to TRANSPOSE_MAX fifths, where each letter and
+ * alter goes. Moving by fifths keeps every interval spelled the way it was; a pitch that would need more than
+ * a double sharp or flat is written on the nearest letter that can take it instead. Each pitch moves by the
+ * smaller of the two ways to the new key (down a tritone rather than up).
+ */
+static spelling_tables build_spelling_tables() {
+    spelling_tables t;
+    for (int d = -TRANSPOSE_MAX; d <= TRANSPOSE_MAX; d++) {
+        int semitones = ((7 * d) % 12 + 12) % 12;
+        if (semitones > 5) semitones -= 12;
+
+        for (int s = 0; s < 7; s++) {
+            for (int a = -2; a <= 2; a++) {
+                int fifths = step_fifths[s] + 7 * a + d;
+                int alter = (fifths + 1 + 7 * 100) / 7 - 100; // floor((fifths + 1) / 7)
+                int pos = fifths - 7 * alter;
+                int step = 0;
+                while (step_fifths[step] != pos) step++;
+
+                // Half steps above the original letter's C, and the new step that spells them.
+                int target = step_classes[s] + a + semitones;
+                while (alter > 2 || alter < -2) {
+                    step = alter > 2 ? (step + 1) % 7 : (step + 6) % 7;
+                    alter = ((target - step_classes[step]) % 12 + 12 + 6) % 12 - 6;
+                }
+
+                spelling& e = t.entries[d + TRANSPOSE_MAX][s][a + 2];
+                e.pitch = step_letters[step];
+                e.alter = (int8_t) alter;
+                e.octave_shift = (int8_t) ((target - step_classes[step] - alter + 120) / 12 - 10);
+            }
+        }
+    }
+    return t;
+}
+
+static const spelling_tables& spellings() {
+    static const spelling_tables tables = build_spelling_tables();
+    return tables;
+}
+
+/**
+ * Copies src into out (reusing its memory) transposed to the key with key_center fifths, in the mode src is
+ * in. Every part moves by the same number of fifths as the first part's key.
+ */
+void transpose_score(const score_view* src, int8_t key_center, score* out) {
+    int d = (int) key_center - src->params[0].key_center;
+    if (d > TRANSPOSE_MAX) d = TRANSPOSE_MAX;
+    if (d < -TRANSPOSE_MAX) d = -TRANSPOSE_MAX;
+    const spelling (*table)[5] = spellings().entries[d + TRANSPOSE_MAX];
+
+    out->params.assign(src->params, src->params + src->part_count);
+    for (auto& p : out->params) p.key_center = (int8_t) (p.key_center + d);
+    out->measures.assign(src->measures, src->measures + src->measure_count);
+    out->chords.assign(src->chords, src->chords + src->chord_count);
+    out->notes.assign(src->notes, src->notes + src->note_count);
+
+    for (auto& nt : out->notes) {
+        int a = nt.alter == INT8_MIN ? 0 : nt.alter;
+        if (nt.pitch < 'A' || nt.pitch > 'G' || a < -2 || a > 2) continue; // Rests, and anything unspellable.
+
+        int s = 0;
+        while (step_letters[s] != nt.pitch) s++;
+        const spelling& e = table[s][a + 2];
+        nt.pitch = e.pitch;
+        // An implied natural stays implied, and other naturals stay written.
+        nt.alter = e.alter == 0 && nt.alter != 0 ? INT8_MIN : e.alter;
+        int octave = nt.octave + e.octave_shift;
+        nt.octave = (uint8_t) (octave < 0 ? 0 : octave);
+    }
+}
+
+/**
+ * Score files hold a merged score exactly as it sits in memory: this header, then the params, measures,
+ * chords and notes arrays, each starting on an 8 byte boundary. They are only meant to be read back on the
+ * machine (or at least the architecture) that wrote them; the sizes and byte order mark catch the rest.
+ */
+#define SCORE_MAGIC "MPSCORE"
+#define SCORE_FORMAT 1
+#define SCORE_BYTE_ORDER 0x01020304u
+
+typedef struct __scoreheader__ {
+    char magic[8];
+    uint32_t format;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint16_t sizes[4]; // sizeof init_params, measure, chord and note.
+    uint64_t counts[4]; // Parts, measures, chords and notes.
+    uint64_t offsets[4]; // Where each array starts, from the start of the file.
+    char parser_version[32];
+} score_header;
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t) 7;
+}
+
+bool is_score_file(const char* data, size_t size) {
+    return size >= sizeof(SCORE_MAGIC) && memcmp(data, SCORE_MAGIC, sizeof(SCORE_MAGIC)) == 0;
+}
+
+/**
+ * Writes a score to out as a score file that load_score can map straight back. Returns 0 on success.
+ */
+int save_view(const score_view* view, FILE* out) {
+    score_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCORE_MAGIC, sizeof(SCORE_MAGIC));
+    h.format = SCORE_FORMAT;
+    h.byte_order = SCORE_BYTE_ORDER;
+    h.header_size = sizeof(score_header);
+    h.sizes[0] = sizeof(init_params);
+    h.sizes[1] = sizeof(measure);
+    h.sizes[2] = sizeof(chord);
+    h.sizes[3] = sizeof(note);
+    h.counts[0] = view->part_count;
+    h.counts[1] = view->measure_count;
+    h.counts[2] = view->chord_count;
+    h.counts[3] = view->note_count;
+    strncpy(h.parser_version, MP_PARSER_VERSION, sizeof(h.parser_version) - 1);
+
+    const void* arrays[4] = { view->params, view->measures, view->chords, view->notes };
+    size_t pos = align8(sizeof(score_header));
+    for (int i = 0; i < 4; i++) {
+        h.offsets[i] = pos;
+        pos = align8(pos + h.counts[i] * h.sizes[i]);
+    }
+
+    static const char padding[8] = {0};
+    if (fwrite(&h, sizeof(h), 1, out) != 1) return 1;
+    pos = sizeof(h);
+    for (int i = 0; i < 4; i++) {
+        size_t bytes = h.counts[i] * h.sizes[i];
+        if (fwrite(padding, 1, h.offsets[i] - pos, out) != h.offsets[i] - pos) return 1;
+        if (bytes && fwrite(arrays[i], 1, bytes, out) != bytes) return 1;
+        pos = h.offsets[i] + bytes;
+    }
+    if (fwrite(padding, 1, align8(pos) - pos, out) != align8(pos) - pos) return 1;
+    return ferror(out) ? 1 : 0;
+}
+
+int save_score(const score* piece, FILE* out) {
+    score_view view = view_score(piece);
+    return save_view(&view, out);
+}
+
+/**
+ * Points view at the arrays of the score file in data, without copying them, after checking that every span
+ * and index in it stays in bounds. data must be 8 byte aligned (a mapping or a malloc'd buffer is) and must
+ * outlive the view. Returns 0 on success, 1 if data is not a usable score file.
+ */
+int load_score(const char* data, size_t size, score_view* view) {
+    if (!is_score_file(data, size) || size < sizeof(score_header) || ((uintptr_t) data & 7) != 0) return 1;
+    score_header h;
+    memcpy(&h, data, sizeof(h));
+    if (h.format != SCORE_FORMAT || h.byte_order != SCORE_BYTE_ORDER || h.header_size != sizeof(score_header)) return 1;
+    if (h.sizes[0] != sizeof(init_params) || h.sizes[1] != sizeof(measure) || h.sizes[2] != sizeof(chord) || h.sizes[3] != sizeof(note)) return 1;
+    if (strncmp(h.parser_version, MP_PARSER_VERSION, sizeof(h.parser_version)) != 0) return 1;
+    for (int i = 0; i < 4; i++) {
+        if (h.offsets[i] % 8 != 0 || h.offsets[i] > size || h.counts[i] > (size - h.offsets[i]) / h.sizes[i]) return 1;
+    }
+
+    view->params = (const init_params*) (data + h.offsets[0]);
+    view->part_count = h.counts[0];
+    view->measures = (const measure*) (data + h.offsets[1]);
+    view->measure_count = h.counts[1];
+    view->chords = (const chord*) (data + h.offsets[2]);
+    view->chord_count = h.counts[2];
+    view->notes = (const note*) (data + h.offsets[3]);
+    view->note_count = h.counts[3];
+
+    // Everything the renderer indexes with has to be checked before it is trusted.
+    if (view->part_count == 0) return 1;
+    for (size_t i = 0; i < view->part_count; i++) {
+        const unsigned char* raw = (const unsigned char*) (view->params + i);
+        if (raw[offsetof(init_params, major)] > 1 || view->params[i].division_count == 0) return 1;
+    }
+    for (size_t i = 0; i < view->measure_count; i++) {
+        const measure& m = view->measures[i];
+        if (m.offset > view->chord_count || m.count > view->chord_count - m.offset) return 1;
+    }
+    for (size_t i = 0; i < view->chord_count; i++) {
+        const chord& c = view->chords[i];
+        if (c.offset > view->note_count || c.count > view->note_count - c.offset || c.part >= view->part_count) return 1;
+    }
+    return 0;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/**
+ * A 128-bit, non-cryptographic hash of size bytes, 16 bytes at a time in two independent lanes. Meant to
+ * tell files apart, not to stand up to anyone crafting collisions.
+ */
+void hash_bytes(const char* data, size_t size, uint64_t seed, uint64_t out[2]) {
+    uint64_t a = seed ^ 0x9e3779b97f4a7c15ULL;
+    uint64_t b = ~seed ^ (uint64_t) size;
+    const char* p = data;
+    const char* end = data + size;
+
+    for (; end - p >= 16; p += 16) {
+        uint64_t w1, w2;
+        memcpy(&w1, p, 8);
+        memcpy(&w2, p + 8, 8);
+        a = rotl64(a ^ (w1 * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+        b = rotl64(b ^ (w2 * 0x4cf5ad432745937fULL), 33) * 0x87c37b91114253d5ULL;
+    }
+
+    uint64_t tail[2] = {0, 0};
+    if (end > p) memcpy(tail, p, (size_t) (end - p));
+    a = mix64(a ^ tail[0]);
+    b = mix64(b ^ tail[1]);
+    out[0] = mix64(a + b);
+    out[1] = mix64(b ^ rotl64(a, 17));
+}
+
+/**
+ * Finds every <part> and <measure> element of input, for ctx->index. Building it costs a tokenizing pass
+ * over the whole document, so it only pays off once it is kept (save_index) and reused.
+ */
+void build_index(const input_buffer* input, file_index* index) {
+    index_builder builder;
+    init_index_builder(&builder, index, input);
+
+    xml_tokenizer tk;
+    init_tokenizer(&tk, input);
+    xml_event ev;
+    while (next_event(&tk, &ev)) index_event(&builder, &ev, tk.pos);
+}
+
+#define INDEX_MAGIC "MPINDEX"
+#define INDEX_FORMAT 1
+
+typedef struct __indexheader__ {
+    char magic[8];
+    uint32_t format;
+    uint32_t byte_order;
+    uint64_t input_size;
+    uint64_t count;
+    char parser_version[32];
+} index_header;
+
+/**
+ * Writes an index to out in the form load_index reads. Like score files, it is only read back by the same
+ * parser version on the same architecture. Returns 0 on success.
+ */
+int save_index(const file_index* index, FILE* out) {
+    index_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    h.format = INDEX_FORMAT;
+    h.byte_order = SCORE_BYTE_ORDER;
+    h.input_size = index->input_size;
+    h.count = index->spans.size();
+    strncpy(h.parser_version, MP_PARSER_VERSION, sizeof(h.parser_version) - 1);
+
+    if (fwrite(&h, sizeof(h), 1, out) != 1) return 1;
+    if (h.count && fwrite(index->spans.data(), sizeof(element_span), h.count, out) != h.count) return 1;
+    return ferror(out) ? 1 : 0;
+}
+
+/**
+ * Reads an index written by save_index. Returns 1 if data is not one, or if any span in it is out of order
+ * or out of bounds.
+ */
+int load_index(const char* data, size_t size, file_index* index) {
+    index_header h;
+    if (size < sizeof(h)) return 1;
+    memcpy(&h, data, sizeof(h));
+    if (memcmp(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || h.format != INDEX_FORMAT || h.byte_order != SCORE_BYTE_ORDER) return 1;
+    if (strncmp(h.parser_version, MP_PARSER_VERSION, sizeof(h.parser_version)) != 0) return 1;
+    if (h.count != (size - sizeof(h)) / sizeof(element_span) || (size - sizeof(h)) % sizeof(element_span) != 0) return 1;
+
+    index->input_size = h.input_size;
+    index->spans.resize(h.count);
+    if (h.count) memcpy(&index->spans[0], data + sizeof(h), h.count * sizeof(element_span));
+    for (size_t i = 0; i < index->spans.size(); i++) {
+        const element_span& span = index->spans[i];
+        if (span.start >= span.end || span.end > h.input_size || (i && span.start <= index->spans[i - 1].start)) return 1;
+    }
+    return 0;
+}
+
+// Changed measures are parsed in place while they fall into at most this many runs. Past that, the parses
+// (one per run) cost about as much as one parse of the whole document.
+const size_t SPLICE_RUNS = 16;
+
+// The piece_print of the bytes [p, end) between two measures.
+static piece_print gap_print(const char* p, const char* end) {
+    uint64_t h[2];
+    hash_bytes(p, (size_t) (end - p), 0, h);
+    piece_print gap = {h[0], PRINT_BLANK};
+    for (; p < end; p++) {
+        if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+            gap.flags = 0;
+            break;
+        }
+    }
+    return gap;
+}
+
+/**
+ * Appends the pieces of doc[begin, end) to pieces, given that spans[first, last) are the elements in it: the bytes
+ * up to its first outermost measure, the measure, the bytes up to the next one, and so on to end.
+ */
+static void hash_pieces(const char* doc, const std::vector<element_span>& spans, size_t first, size_t last,
+                        uint64_t begin, uint64_t end, std::vector<piece_print>* pieces) {
+    uint64_t pos = begin;
+    uint64_t h[2];
+    for (size_t i = first; i < last; i++) {
+        // A timewise measure's parts lie within it.
+        const element_span& span = spans[i];
+        if (span.is_part || span.start < pos) continue;
+        pieces->push_back(gap_print(doc + pos, doc + span.start));
+
+        const char* data = doc + span.start;
+        size_t size = (size_t) (span.end - span.start);
+        hash_bytes(data, size, 0, h);
+        piece_print measure = {h[0], memmem(data, size, "<" S_ATTRIBUTES, sizeof(S_ATTRIBUTES)) ? PRINT_ATTRIBUTES : 0};
+        pieces->push_back(measure);
+        pos = span.end;
+    }
+    pieces->push_back(gap_print(doc + pos, doc + end));
+}
+
+/**
+ * Works out the index and pieces of input from those of print's document, taking input to be that document
+ * with one stretch of it edited. Pieces that still hash the same are matched from the front and from the back,
+ * and only the measures between them are tokenized again, so an edit costs a pass of hash_bytes over the rest.
+ * Returns false, leaving it to a whole parse, if print has no document or the edit reaches into a <part> tag.
+ */
+static bool update_index(const input_buffer* input, const conversion_print* print, file_index* index, std::vector<piece_print>* pieces) {
+    const file_index& old = print->index;
+    std::vector<uint64_t> bounds(1, 0);
+    for (const element_span& span : old.spans) {
+        if (span.is_part || span.start < bounds.back()) continue;
+        bounds.push_back(span.start);
+        bounds.push_back(span.end);
+    }
+    bounds.push_back(old.input_size);
+    size_t count = bounds.size() - 1;
+    if (print->measures.empty() || print->pieces.size() != count) return false;
+
+    const char* doc = input->data;
+    int64_t delta = (int64_t) input->size - (int64_t) old.input_size;
+    uint64_t h[2];
+    size_t first = 0;
+    while (first < count && bounds[first + 1] <= input->size) {
+        hash_bytes(doc + bounds[first], (size_t) (bounds[first + 1] - bounds[first]), 0, h);
+        if (h[0] != print->pieces[first].hash) break;
+        first++;
+    }
+    size_t last = count;
+    while (last > first && (int64_t) bounds[last - 1] + delta >= (int64_t) bounds[first]) {
+        hash_bytes(doc + bounds[last - 1] + delta, (size_t) (bounds[last] - bounds[last - 1]), 0, h);
+        if (h[0] != print->pieces[last - 1].hash) break;
+        last--;
+    }
+    // The stretch tokenized again runs from the start of one gap between measures to the end of another.
+    if (first == last && first == count) {
+        first--;
+    } else if (first == last) {
+        last++;
+    }
+    if (first % 2) first--;
+    if (last % 2 == 0) last++;
+    uint64_t begin = bounds[first];
+    uint64_t old_end = bounds[last];
+    uint64_t end = (uint64_t) ((int64_t) old_end + delta);
+
+    index->input_size = input->size;
+    index->spans.clear();
+    size_t s = 0;
+    const element_span* before = NULL; // The last measure before the stretch.
+    for (; s < old.spans.size() && old.spans[s].start < begin; s++) {
+        element_span span = old.spans[s];
+        if (span.end > begin) {
+            if (span.end < old_end) return false;
+            span.end = (uint64_t) ((int64_t) span.end + delta);
+        }
+        if (!span.is_part) before = &old.spans[s];
+        index->spans.push_back(span);
+    }
+    // The stretch goes on numbering from that measure, unless its (partwise) part ended in between.
+    uint32_t number = before ? before->number : 0;
+    for (size_t i = 0; before && i < s; i++) {
+        if (old.spans[i].is_part && old.spans[i].end > before->end && old.spans[i].end <= begin) number = 0;
+    }
+    uint32_t old_number = number;
+    for (; s < old.spans.size() && old.spans[s].start < old_end; s++) {
+        if (old.spans[s].end > old_end) return false;
+        if (!old.spans[s].is_part) old_number = old.spans[s].number;
+    }
+
+    // Measures may only open at the top of the stretch, and parts only within them (as in a timewise score).
+    input_buffer stretch = {doc + begin, (size_t) (end - begin), false};
+    xml_tokenizer tk;
+    init_tokenizer(&tk, &stretch);
+    xml_event ev;
+    std::vector<size_t> open;
+    size_t edited = index->spans.size();
+    while (next_event(&tk, &ev)) {
+        if (ev.type == XML_TEXT || (ev.id != T_PART && ev.id != T_MEASURE && ev.id != T_SCORE_TIMEWISE)) continue;
+        if (ev.id == T_SCORE_TIMEWISE) return false;
+        if (ev.type == XML_OPEN) {
+            if (ev.id == T_MEASURE ? !open.empty() : open.empty() || index->spans[open.back()].is_part) return false;
+            if (ev.id == T_MEASURE) number = measure_number(&ev, number);
+            element_span span = {begin + (uint64_t) (ev.tag.data - 1 - stretch.data), end, number, ev.id == T_PART};
+            open.push_back(index->spans.size());
+            index->spans.push_back(span);
+        } else {
+            if (open.empty() || index->spans[open.back()].is_part != (ev.id == T_PART)) return false;
+            index->spans[open.back()].end = begin + (uint64_t) (tk.pos - stretch.data);
+            open.pop_back();
+        }
+    }
+    if (!open.empty()) return false;
+
+    // A measure after the stretch without a number of its own goes on from the last one in it.
+    if (number != old_number && s < old.spans.size() && !old.spans[s].is_part) {
+        input_buffer next = {doc + old.spans[s].start + delta, (size_t) (old.spans[s].end - old.spans[s].start), false};
+        init_tokenizer(&tk, &next);
+        if (!next_event(&tk, &ev) || measure_number(&ev, number) != old.spans[s].number) return false;
+    }
+
+    pieces->assign(print->pieces.begin(), print->pieces.begin() + first);
+    hash_pieces(doc, index->spans, edited, index->spans.size(), begin, end, pieces);
+    pieces->insert(pieces->end(), print->pieces.begin() + last, print->pieces.end());
+    for (; s < old.spans.size(); s++) {
+        element_span span = old.spans[s];
+        span.start = (uint64_t) ((int64_t) span.start + delta);
+        span.end = (uint64_t) ((int64_t) span.end + delta);
+        index->spans.push_back(span);
+    }
+    return true;
+}
+
+/**
+ * The parser version and every render option that changes the output, which conversions kept between runs
+ * (the conversion cache, a print's frame) are keyed by.
+ */
+std::string render_salt(const render_options* opts) {
+    std::string salt = MP_PARSER_VERSION;
+    salt += opts->ml_flag ? "\nml\n" : "\nplain\n";
+    if (opts->tokens) salt += "tokens\n";
+    if (opts->key_override) salt += opts->key_override;
+    if (opts->repeats) salt += "\nrepeats=" + std::to_string(opts->repeats);
+    return salt;
+}
+
+/**
+ * Fingerprints the measures of a document from its index and pieces, one per measure number, in the order a
+ * parse files them into the measure table. The pieces between measures that are not blank go into *frame,
+ * along with opts.
+ */
+static void fingerprint(const file_index* index, const std::vector<piece_print>& pieces, const render_options* opts,
+                        std::vector<measure_print>* rows, uint64_t* frame) {
+    std::string salt = render_salt(opts);
+    uint64_t h[2];
+    hash_bytes(salt.data(), salt.size(), 0, h);
+    uint64_t outer = h[0];
+
+    rows->clear();
+    std::unordered_map<uint32_t, size_t> row_of;
+    const piece_print* piece = pieces.data();
+    uint64_t pos = 0;
+    for (const element_span& span : index->spans) {
+        if (span.is_part || span.start < pos) continue;
+        // Space between measures comes and goes with them, and means nothing.
+        if (!(piece->flags & PRINT_BLANK)) outer = mix64(rotl64(outer, 23) ^ piece->hash);
+        piece++;
+
+        auto found = row_of.emplace(span.number, rows->size());
+        if (found.second) {
+            measure_print fresh = {0, 0, 0, 0, span.number, 0};
+            rows->push_back(fresh);
+        }
+        measure_print& row = (*rows)[found.first->second];
+        row.input = mix64(rotl64(row.input, 23) ^ piece->hash);
+        row.flags |= (uint32_t) piece->flags;
+        piece++;
+        pos = span.end;
+    }
+    *frame = piece->flags & PRINT_BLANK ? outer : mix64(rotl64(outer, 23) ^ piece->hash);
+}
+
+// Hash of the beats of a merged measure.
+static void beats_hash(const score_view* piece, const measure& m, uint64_t seed, uint64_t h[2]) {
+    h[0] = seed;
+    h[1] = 0;
+    for (const chord* c = piece->chords + m.offset; c < piece->chords + m.offset + m.count; c++) {
+        uint64_t shape = ((uint64_t) c->count << 32) | ((uint64_t) c->duration << 8) | c->part;
+        hash_bytes((const char*) (piece->notes + c->offset), c->count * sizeof(note), h[0] ^ mix64(shape), h);
+    }
+}
+
+/**
+ * Writes m as a reference to the last measure written with the same beats, if it has any and that measure is
+ * at most opts->repeats back (REPEAT_TOKENS for tokens), and returns true. Every measure is counted either way.
+ */
+bool display_repeat(render_state* rs, const measure& m) {
+    repeat_table* table = rs->repeats;
+    uint64_t position = table->written++;
+    if (m.count == 0) return false;
+
+    uint64_t h[2];
+    beats_hash(&rs->piece, m, 0, h);
+    repeat_entry fresh = {h[1], position, m.measure_num};
+    auto found = table->seen.emplace(h[0], fresh);
+    if (found.second) return false;
+    repeat_entry last = found.first->second;
+    found.first->second = fresh;
+    uint64_t reach = rs->opts->tokens ? std::min(rs->opts->repeats, REPEAT_TOKENS) : rs->opts->repeats;
+    if (last.check != h[1] || position - last.position > reach) return false;
+
+    if (rs->opts->tokens) {
+        out_token(rs->out, (uint16_t) (TOK_REPEAT + (position - last.position) - 1));
+        out_token(rs->out, TOK_BAR);
+    } else {
+        out_char(rs->out, 'M');
+        out_int(rs->out, (int32_t) m.measure_num);
+        out_str(rs->out, ": =M", 4);
+        out_int(rs->out, (int32_t) last.measure_num);
+        out_str(rs->out, " |\n", 3);
+    }
+    if (rs->opts->stats) STAT_ADD(rs->opts->stats, repeated, 1);
+    if (rs->out->data.size() >= OUT_CHUNK) out_flush(rs->out);
+    return true;
+}
+
+// Hash of a merged measure, never 0.
+static uint64_t measure_hash(const score* piece, const measure& m) {
+    score_view view = view_score(piece);
+    uint64_t h[2];
+    beats_hash(&view, m, m.measure_num, h);
+    return h[0] ? h[0] : 1;
+}
+
+// Renders m onto the end of the text and notes where it went in row.
+static void print_measure(render_state* rs, const score* piece, const measure& m, measure_print* row) {
+    STAT_TIMER(timer, rs->opts->stats ? &rs->opts->stats->render_ns : NULL);
+    row->output = measure_hash(piece, m);
+    row->text_offset = rs->out->data.size();
+    display_measure(rs, m);
+    row->text_length = rs->out->data.size() - row->text_offset;
+    if (rs->opts->stats) STAT_ADD(rs->opts->stats, measures, 1);
+}
+
+/**
+ * Converts the whole of input into print, indexing it on the way.
+ */
+static int convert_print(parse_context* ctx, const input_buffer* input, const render_options* opts, conversion_print* print) {
+    ctx->record = &print->index;
+    int failed = parse(ctx, input);
+    ctx->record = NULL;
+    if (failed) return 1;
+
+    print->pieces.clear();
+    hash_pieces(input->data, print->index.spans, 0, print->index.spans.size(), 0, input->size, &print->pieces);
+    std::vector<measure_print> rows;
+    fingerprint(&print->index, print->pieces, opts, &rows, &print->frame);
+    std::unordered_map<uint32_t, size_t> row_of;
+    for (size_t i = 0; i < rows.size(); i++) row_of[rows[i].measure_num] = i;
+
+    print->measures.clear();
+    size_t count = ctx->measure_table.size();
+    for (size_t r = 0; r < count; r++) {
+        const measure_row& table_row = ctx->measure_table[r];
+        auto found = row_of.find(table_row.measure_num);
+        // A row the index does not know of is never taken over.
+        measure_print row = {0, 0, 0, 0, table_row.measure_num, PRINT_ATTRIBUTES};
+        if (found != row_of.end()) row = rows[found->second];
+        if (table_row.ragged) row.flags |= PRINT_RAGGED;
+        row.output = row_empty(ctx, r) && r + 1 != count ? 0 : 1;
+        print->measures.push_back(row);
+    }
+    merge_measures(ctx);
+
+    out_buffer ob;
+    ob.sink = NULL;
+    ob.failed = false;
+    ob.data.swap(print->text);
+    ob.data.clear();
+    repeat_table repeats;
+    repeats.written = 0;
+    render_state rs;
+    rs.piece = view_score(&ctx->piece);
+    rs.opts = opts;
+    rs.out = &ob;
+    rs.repeats = opts->repeats ? &repeats : NULL;
+
+    display_part(&rs, ctx->piece.params[0]);
+    print->header_length = ob.data.size();
+    const measure* m = ctx->piece.measures.data();
+    for (auto& row : print->measures) {
+        row.text_offset = ob.data.size();
+        row.text_length = 0;
+        if (row.output) print_measure(&rs, &ctx->piece, *m++, &row);
+    }
+    size_t footer = ob.data.size();
+    // Without any rows, merge_measures leaves a single empty measure, which goes in the footer.
+    for (; m < ctx->piece.measures.data() + ctx->piece.measures.size(); m++) display_measure(&rs, *m);
+    if (opts->tokens) out_token(&ob, TOK_EOS);
+    print->footer_length = ob.data.size() - footer;
+    ob.data.swap(print->text);
+    return 0;
+}
+
+/**
+ * Brings print's measures and text up to date with input, whose index and fingerprints are given, by parsing
+ * only the runs of measures that differ from print's, each with ctx->select narrowed to the run. Returns nonzero,
+ * leaving print as it was, wherever that could come out different from converting the whole document.
+ */
+static int splice_print(parse_context* ctx, const input_buffer* input, const file_index* index, const render_options* opts,
+                        const std::vector<measure_print>& rows, conversion_print* print) {
+    const std::vector<measure_print>& old = print->measures;
+    std::unordered_map<uint32_t, size_t> old_row;
+    for (size_t j = 0; j < old.size(); j++) old_row[old[j].measure_num] = j;
+
+    // A measure is kept if its XML and its neighbours are as before; from[i] is then its old row.
+    size_t n = rows.size();
+    std::vector<size_t> from(n, SIZE_MAX);
+    std::vector<bool> old_kept(old.size(), false);
+    for (size_t i = 0; i < n; i++) {
+        auto found = old_row.find(rows[i].measure_num);
+        if (found == old_row.end()) continue;
+        size_t j = found->second;
+        if (old[j].input == rows[i].input && (i == 0) == (j == 0) && (i + 1 == n) == (j + 1 == old.size())
+            && (i == 0 || old[j - 1].measure_num == rows[i - 1].measure_num)) {
+            from[i] = j;
+            old_kept[j] = true;
+        }
+    }
+    // Divisions, key and meter reach past their own measure.
+    for (size_t i = 0; i < n; i++) {
+        if (from[i] == SIZE_MAX && (rows[i].flags & PRINT_ATTRIBUTES)) return 1;
+    }
+    for (size_t j = 0; j < old.size(); j++) {
+        if (!old_kept[j] && (old[j].flags & PRINT_ATTRIBUTES)) return 1;
+    }
+
+    // Each run of changed measures has to start and end on a beat, and be all there is in its range of numbers.
+    size_t runs = 0;
+    for (size_t a = 0; a < n; a++) {
+        if (from[a] != SIZE_MAX) continue;
+        size_t b = a;
+        while (b + 1 < n && from[b + 1] == SIZE_MAX) b++;
+        if (++runs > SPLICE_RUNS) return 1;
+        if (a > 0 && (old[from[a - 1]].flags & PRINT_RAGGED)) return 1;
+        if (b + 1 < n && (old[from[b + 1] - 1].flags & PRINT_RAGGED)) return 1;
+
+        uint32_t lo = UINT32_MAX, hi = 0;
+        for (size_t i = a; i <= b; i++) {
+            lo = std::min(lo, rows[i].measure_num);
+            hi = std::max(hi, rows[i].measure_num);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if ((i < a || i > b) && rows[i].measure_num >= lo && rows[i].measure_num <= hi) return 1;
+        }
+        a = b;
+    }
+
+    std::vector<measure_print> fresh(rows);
+    out_buffer ob;
+    ob.sink = NULL;
+    ob.failed = false;
+    ob.data.reserve(print->text.size() + print->text.size() / 8);
+    ob.data.append(print->text, 0, print->header_length);
+    render_state rs;
+    rs.opts = opts;
+    rs.out = &ob;
+    rs.repeats = NULL;
+
+    selection keep = ctx->select;
+    const file_index* keep_index = ctx->index;
+    ctx->index = index;
+    int failed = 0;
+    size_t spliced = 0;
+    std::vector<bool> empty;
+    for (size_t a = 0; a < n && !failed; a++) {
+        if (from[a] != SIZE_MAX) {
+            const measure_print& was = old[from[a]];
+            fresh[a] = was;
+            fresh[a].text_offset = ob.data.size();
+            ob.data.append(print->text, was.text_offset, was.text_length);
+            spliced++;
+            continue;
+        }
+        size_t b = a;
+        while (b + 1 < n && from[b + 1] == SIZE_MAX) b++;
+
+        select_all(&ctx->select);
+        ctx->select.first_measure = UINT32_MAX;
+        ctx->select.last_measure = 0;
+        for (size_t i = a; i <= b; i++) {
+            ctx->select.first_measure = std::min(ctx->select.first_measure, rows[i].measure_num);
+            ctx->select.last_measure = std::max(ctx->select.last_measure, rows[i].measure_num);
+        }
+        failed = parse(ctx, input) != 0 || ctx->measure_table.size() != b - a + 1;
+        empty.assign(b - a + 1, false);
+        for (size_t k = 0; !failed && k <= b - a; k++) {
+            const measure_row& table_row = ctx->measure_table[k];
+            failed = table_row.measure_num != rows[a + k].measure_num || (table_row.ragged && a + k == b);
+            if (table_row.ragged) fresh[a + k].flags |= PRINT_RAGGED;
+            empty[k] = row_empty(ctx, k);
+        }
+        if (failed) break;
+        merge_measures(ctx);
+
+        rs.piece = view_score(&ctx->piece);
+        const measure* m = ctx->piece.measures.data();
+        for (size_t i = a; i <= b; i++) {
+            measure_print& row = fresh[i];
+            row.text_offset = ob.data.size();
+            row.text_length = 0;
+            row.output = 0;
+            // Empty measures are dropped, except for the last of the run by merge_measures and the last of the piece here.
+            if (empty[i - a] && i != b) continue;
+            const measure& merged = *m++;
+            if (empty[i - a] && i + 1 != n) continue;
+
+            auto found = old_row.find(row.measure_num);
+            uint64_t output = measure_hash(&ctx->piece, merged);
+            if (found != old_row.end() && old[found->second].output == output) {
+                row.output = output;
+                ob.data.append(print->text, old[found->second].text_offset, old[found->second].text_length);
+                row.text_length = ob.data.size() - row.text_offset;
+            } else {
+                print_measure(&rs, &ctx->piece, merged, &row);
+            }
+        }
+        a = b;
+    }
+    ctx->select = keep;
+    ctx->index = keep_index;
+    if (failed) return 1;
+
+    ob.data.append(print->text, print->text.size() - print->footer_length, print->footer_length);
+    STAT_ADD(&ctx->stats, spliced, spliced);
+    if (opts->stats) STAT_ADD(opts->stats, measures, spliced);
+    print->measures.swap(fresh);
+    print->text.swap(ob.data);
+    return 0;
+}
+
+/**
+ * Converts input with opts into print->text, where print holds the document's previous conversion with the
+ * same options (or is empty). Only the measures whose XML changed since are parsed, merged and rendered; the
+ * rest are copied from the previous text. Whenever a change could reach further than its own measures, such
+ * as through <attributes>, a beat left open at a barline, or anything outside the measures, the whole document
+ * is converted instead. Either way print is left describing the new conversion, and the whole document is
+ * converted whatever ctx->select says. Returns nonzero if the document holds no parts.
+ */
+int reconvert(parse_context* ctx, const input_buffer* input, const render_options* opts, conversion_print* print) {
+    file_index index;
+    std::vector<piece_print> pieces;
+    std::vector<measure_print> rows;
+    uint64_t frame = 0;
+    bool synced;
+    {
+        STAT_TIMER(timer, &ctx->stats.parse_ns);
+        synced = update_index(input, print, &index, &pieces);
+        if (synced) fingerprint(&index, pieces, opts, &rows, &frame);
+    }
+    // A measure written as a reference depends on the ones before it, so none can be taken over.
+    if (synced && frame == print->frame && !opts->repeats && splice_print(ctx, input, &index, opts, rows, print) == 0) {
+        print->index.spans.swap(index.spans);
+        print->index.input_size = index.input_size;
+        print->pieces.swap(pieces);
+        return 0;
+    }
+
+    selection keep = ctx->select;
+    const file_index* keep_index = ctx->index;
+    select_all(&ctx->select);
+    ctx->index = NULL;
+    int failed = convert_print(ctx, input, opts, print);
+    ctx->select = keep;
+    ctx->index = keep_index;
+    return failed;
+}
+
+#define PRINT_MAGIC "MPPRINT"
+#define PRINT_FORMAT 1
+
+typedef struct __printheader__ {
+    char magic[8];
+    uint32_t format;
+    uint32_t byte_order;
+    uint64_t frame;
+    uint64_t header_length;
+    uint64_t footer_length;
+    uint64_t input_size;
+    uint64_t span_count;
+    uint64_t piece_count;
+    uint64_t measure_count;
+    uint64_t text_size;
+    char parser_version[32];
+} print_header;
+
+/**
+ * Writes a conversion print to out in the form load_print reads, which like an index is only read back by the
+ * same parser version on the same architecture. Returns 0 on success.
+ */
+int save_print(const conversion_print* print, FILE* out) {
+    print_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PRINT_MAGIC, sizeof(PRINT_MAGIC));
+    h.format = PRINT_FORMAT;
+    h.byte_order = SCORE_BYTE_ORDER;
+    h.frame = print->frame;
+    h.header_length = print->header_length;
+    h.footer_length = print->footer_length;
+    h.input_size = print->index.input_size;
+    h.span_count = print->index.spans.size();
+    h.piece_count = print->pieces.size();
+    h.measure_count = print->measures.size();
+    h.text_size = print->text.size();
+    strncpy(h.parser_version, MP_PARSER_VERSION, sizeof(h.parser_version) - 1);
+
+    if (fwrite(&h, sizeof(h), 1, out) != 1) return 1;
+    if (h.span_count && fwrite(print->index.spans.data(), sizeof(element_span), h.span_count, out) != h.span_count) return 1;
+    if (h.piece_count && fwrite(print->pieces.data(), sizeof(piece_print), h.piece_count, out) != h.piece_count) return 1;
+    if (h.measure_count && fwrite(print->measures.data(), sizeof(measure_print), h.measure_count, out) != h.measure_count) return 1;
+    if (h.text_size && fwrite(print->text.data(), 1, h.text_size, out) != h.text_size) return 1;
+    return ferror(out) ? 1 : 0;
+}
+
+/**
+ * Reads a conversion print written by save_print. Returns 1 if data is not one, if its spans are out of order
+ * or out of bounds, or if its measures do not tile its text between the header and the footer.
+ */
+int load_print(const char* data, size_t size, conversion_print* print) {
+    print_header h;
+    if (size < sizeof(h)) return 1;
+    memcpy(&h, data, sizeof(h));
+    if (memcmp(h.magic, PRINT_MAGIC, sizeof(PRINT_MAGIC)) != 0 || h.format != PRINT_FORMAT || h.byte_order != SCORE_BYTE_ORDER) return 1;
+    if (strncmp(h.parser_version, MP_PARSER_VERSION, sizeof(h.parser_version)) != 0) return 1;
+    const char* p = data + sizeof(h);
+    size -= sizeof(h);
+    if (h.span_count > size / sizeof(element_span)) return 1;
+    size -= h.span_count * sizeof(element_span);
+    if (h.piece_count > size / sizeof(piece_print)) return 1;
+    size -= h.piece_count * sizeof(piece_print);
+    if (h.measure_count > size / sizeof(measure_print) || h.text_size != size - h.measure_count * sizeof(measure_print)) return 1;
+    if (h.header_length > h.text_size || h.footer_length > h.text_size - h.header_length) return 1;
+
+    print->frame = h.frame;
+    print->header_length = h.header_length;
+    print->footer_length = h.footer_length;
+    print->index.input_size = h.input_size;
+    print->index.spans.resize(h.span_count);
+    if (h.span_count) memcpy(&print->index.spans[0], p, h.span_count * sizeof(element_span));
+    p += h.span_count * sizeof(element_span);
+    print->pieces.resize(h.piece_count);
+    if (h.piece_count) memcpy(&print->pieces[0], p, h.piece_count * sizeof(piece_print));
+    p += h.piece_count * sizeof(piece_print);
+    print->measures.resize(h.measure_count);
+    if (h.measure_count) memcpy(&print->measures[0], p, h.measure_count * sizeof(measure_print));
+    p += h.measure_count * sizeof(measure_print);
+    print->text.assign(p, h.text_size);
+
+    for (size_t i = 0; i < print->index.spans.size(); i++) {
+        const element_span& span = print->index.spans[i];
+        if (span.start >= span.end || span.end > h.input_size || (i && span.start <= print->index.spans[i - 1].start)) return 1;
+    }
+    uint64_t pos = h.header_length;
+    for (const measure_print& row : print->measures) {
+        if (row.text_offset != pos || row.text_length > h.text_size - h.footer_length - pos) return 1;
+        pos += row.text_length;
+    }
+    return pos == h.text_size - h.footer_length ? 0 : 1;
+}
+
+parse_context* musicparse_new(void) {
+    parse_context* ctx = new (std::nothrow) parse_context;
+    if (ctx) init_context(ctx);
+    return ctx;
+}
+
+void musicparse_free(parse_context* ctx) {
+    delete ctx;
+}
+
+/**
+ * Converts size bytes of MusicXML to inline notation. Returns a NUL-terminated string to release with
+ * musicparse_free_text, or NULL if the document could not be converted.
+ */
+char* musicparse_convert(parse_context* ctx, const char* data, size_t size, int ml_flag) {
+    const score* piece = parse_score(ctx, data, size);
+    if (!piece) return NULL;
+
+    render_options opts;
+    opts.ml_flag = ml_flag != 0;
+    opts.tokens = false;
+    opts.key_override = NULL;
+    opts.repeats = 0;
+    opts.stats = NULL;
+
+    std::string text;
+    if (render(piece, &opts, &text) != 0) return NULL;
+
+    char* out = (char*) malloc(text.size() + 1);
+    if (out) memcpy(out, text.c_str(), text.size() + 1);
+    return out;
+}
+
+void musicparse_free_text(char* text) {
+    free(text);
+}
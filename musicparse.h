@@ -0,0 +1,383 @@
+#ifndef MUSICPARSE_H
+#define MUSICPARSE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+
+// Bump whenever a change alters the output for some input. The conversion cache keys on it.
+#define MP_PARSER_VERSION "musicparse-2"
+
+/**
+ * The MusicXML to inline notation converter as a library. A parse_context holds everything one document
+ * needs, so any number of contexts can convert documents on different threads at once:
+ *
+ *     parse_context ctx;
+ *     init_context(&ctx);
+ *     const score* piece = parse_score(&ctx, data, size);
+ *     std::string text;
+ *     if (piece) render(piece, &options, &text);
+ *
+ * A context (and the score it returns) is reused by the next parse_score call on it.
+ */
+
+typedef struct __initparams__ {
+    uint16_t beats; // # Beats in a Measure
+    uint16_t beat_type; // Beat Subdivision
+    uint8_t division_count; // Division Count
+    int8_t key_center; // Key Center, represented by # Fifths
+    bool major; // Modality (Major = True, Minor = False)
+} init_params;
+
+typedef struct __note__ {
+    uint8_t octave;
+    uint8_t duration;
+    uint8_t part;
+    uint8_t voice;
+    int8_t alter;
+    char pitch;
+} note;
+
+typedef struct __notegroup__ {
+    uint32_t offset; // Index of the first voice in the owning note array.
+    uint16_t count; // Number of voices, stored contiguously. Notes that are part of the chord. Can include passing tones.
+    uint16_t duration; // The length of the chord. Should be a multiple of 2 but can be a multiple of 3.
+    uint8_t part; // The part which this note group is in.
+} chord;
+
+typedef struct __inputbuf__ {
+    const char* data; // Start of the file bytes (NOT null terminated).
+    size_t size; // Number of bytes in data.
+    bool mapped; // True if data is an mmap of the file, false if it was read into heap memory.
+} input_buffer;
+
+typedef struct __measure__ {
+    uint32_t offset; // Index of the first beat in the owning chord array.
+    uint32_t count; // Number of beats, stored contiguously.
+    uint32_t measure_num; // measure number. This is used to index into measure list.
+} measure;
+
+typedef struct __beatlist__ {
+    std::vector<note> notes; // The voices of every chord, chord after chord.
+    std::vector<chord> chords; // The beats, as spans of notes.
+} beat_list;
+
+typedef struct __score__ {
+    std::vector<note> notes; // Every note of the piece in one contiguous array.
+    std::vector<chord> chords; // Every beat, as spans of notes.
+    std::vector<measure> measures; // The measures in display order, as spans of chords.
+    std::vector<init_params> params; // Each part's attributes. After merging they share one division count.
+} score;
+
+// One part/voice run of a measure as merge_beats walks it.
+typedef struct __voicerun__ {
+    size_t chord; // The run's current chord.
+    size_t end; // One past its last chord.
+    uint32_t start; // When the current chord starts, in divisions from the start of the measure.
+} voice_run;
+
+typedef struct __mergework__ {
+    beat_list part; // One part's copy of a measure while handle_dots runs on it.
+    beat_list consolidated; // All parts of a measure, back to back.
+    beat_list merged; // The merged beats of the measure.
+    std::vector<voice_run> runs;
+    std::vector<note> front; // The voices of the beat being merged that went below the first run's, last first.
+    std::vector<note> back; // And the rest, in order.
+} merge_work;
+
+// A read-only look at a merged score, whether it is held in a score or in a mapped score file (save_score).
+typedef struct __scoreview__ {
+    const note* notes;
+    size_t note_count;
+    const chord* chords;
+    size_t chord_count;
+    const measure* measures;
+    size_t measure_count;
+    const init_params* params;
+    size_t part_count;
+} score_view;
+
+/**
+ * Counters and stage times (in nanoseconds) that --stats reports. They only ever grow; clear_stats resets them.
+ * Building with -DMP_NO_STATS (make STATS=0) compiles every STAT_ADD and STAT_TIMER away.
+ */
+typedef struct __stats__ {
+    uint64_t files;
+    uint64_t bytes; // Input bytes scanned.
+    uint64_t tags; // Opening tags seen.
+    uint64_t notes;
+    uint64_t chords; // Beats as parsed, before merging.
+    uint64_t measures; // Measures written out.
+    uint64_t repeated; // Of those, the ones written as a reference to an earlier measure (render_options.repeats).
+    uint64_t merges; // Part/voice runs merged by merge_beats.
+    uint64_t allocations; // Only counted in COUNT_ALLOCS builds.
+    uint64_t cache_hits; // Files served from the conversion cache without parsing.
+    uint64_t spliced; // Measures reconvert took over from the previous conversion instead of parsing them.
+
+    uint64_t read_ns; // Opening or reading the input.
+    uint64_t parse_ns; // Tokenizing with init_parse and note_parse (and, when streaming, everything after).
+    uint64_t handle_dots_ns;
+    uint64_t merge_beats_ns;
+    uint64_t merge_ns; // All of merge_measures, handle_dots and merge_beats included.
+    uint64_t render_ns;
+} conv_stats;
+
+// Adds the time until it goes out of scope to *ns, if ns is not NULL.
+struct stat_timer {
+    uint64_t* ns;
+    std::chrono::steady_clock::time_point start;
+
+    explicit stat_timer(uint64_t* target) : ns(target) {
+        if (ns) start = std::chrono::steady_clock::now();
+    }
+    ~stat_timer() {
+        if (ns) *ns += (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+#ifndef MP_NO_STATS
+#define STAT_ADD(stats, field, n) ((stats)->field += (n))
+#define STAT_TIMER(name, target) stat_timer name(target)
+#else
+#define STAT_ADD(stats, field, n) ((void) 0)
+#define STAT_TIMER(name, target) ((void) 0)
+#endif
+
+// The parts and measures a parse keeps. The rest are jumped over without being tokenized.
+typedef struct __selection__ {
+    std::vector<bool> parts; // Empty keeps every part; otherwise the i-th part (from 0, in document order) is kept if parts[i].
+    uint32_t first_measure; // Measures numbered outside [first_measure, last_measure] are left out.
+    uint32_t last_measure;
+} selection;
+
+// Where a <part> or <measure> element sits in a document, in bytes from its start.
+typedef struct __elementspan__ {
+    uint64_t start; // Its '<'.
+    uint64_t end; // One past the '>' that closes it.
+    uint32_t number; // The measure number a parse would give a <measure>.
+    uint32_t is_part;
+} element_span;
+
+// Every <part> and <measure> element of one document in document order, as build_index finds them.
+typedef struct __fileindex__ {
+    uint64_t input_size; // The document's size. An index is ignored for any document of another size.
+    std::vector<element_span> spans;
+} file_index;
+
+// One thread's share of a parallel merge_measures: a run of rows merged into measures of its own.
+typedef struct __mergeshare__ {
+    merge_work work;
+    score merged; // Only notes, chords and measures are used.
+    conv_stats stats;
+} merge_share;
+
+// One part's copy of a measure, filed in its row of the measure table.
+typedef struct __filedmeasure__ {
+    measure span; // A span of parsed.chords.
+    uint32_t older; // The copy that arrived before it in the same row, or NO_MEASURE.
+} filed_measure;
+
+// A row of the measure table: every part's copy of one measure number, chained newest first.
+typedef struct __measurerow__ {
+    uint32_t newest;
+    uint32_t measure_num;
+    bool ragged; // Some part left the measure partway into a beat, which shifts the beats of the next one.
+} measure_row;
+
+const uint32_t NO_MEASURE = UINT32_MAX;
+
+// A slot of row_index. It only holds an entry while its generation is the index's.
+typedef struct __indexslot__ {
+    uint32_t measure_num;
+    uint32_t row;
+    uint32_t generation;
+} index_slot;
+
+// Measure numbers to rows, by open addressing over one array. Clearing it bumps the generation, which
+// empties every slot at once without touching them.
+typedef struct __rowindex__ {
+    std::vector<index_slot> slots; // A power of two in size.
+    uint32_t generation;
+    size_t used;
+} row_index;
+
+typedef struct __strview__ {
+    const char* data; // Points into the input buffer.
+    size_t len;
+} str_view;
+
+typedef struct __xmlattr__ {
+    str_view name;
+    str_view value;
+} xml_attribute;
+
+// Per-part and per-row bookkeeping of a parse, handed back to the context afterwards to keep its memory.
+typedef struct __parsescratch__ {
+    std::vector<xml_attribute> attributes; // The tokenizer's attribute list.
+    std::vector<bool> params_set;
+    std::vector<str_view> part_ids;
+    std::vector<uint16_t> part_div_counts;
+    std::vector<bool> row_done;
+} parse_scratch;
+
+/**
+ * Everything one document needs from parsing to display. A context can be reused for any number of
+ * documents (one at a time); reset_context clears it but keeps the memory it has grown. Every per-document
+ * structure lives in these flat arrays, so once a context has seen its largest document it stops allocating,
+ * and forgetting a document costs the same however large it was.
+ */
+typedef struct __context__ {
+    std::vector<init_params> part_params;
+    score piece; // The merged piece, once merge_measures has run.
+
+    // Notes and beats as parsed, before merge_measures. measure_table[i] chains every part's copy of the i-th
+    // distinct measure number through filed_measures, and measure_index maps a measure number to its row.
+    beat_list parsed;
+    std::vector<filed_measure> filed_measures;
+    std::vector<measure_row> measure_table;
+    row_index measure_index;
+    parse_scratch scratch;
+
+    merge_work work;
+    std::vector<merge_share> shares; // Kept from one parallel merge_measures to the next.
+    unsigned merge_threads; // Threads merge_measures may use. init_context sets 1, the calling thread alone.
+    selection select; // What parsing keeps. init_context keeps everything.
+    const file_index* index; // If set, an index of the next document, used to jump straight over what select leaves out.
+    file_index* record; // If set, parsing a whole document (select keeps everything) indexes it here as it goes.
+    conv_stats stats; // Summed over every document parsed with the context.
+} parse_context;
+
+/**
+ * Token IDs for render_options.tokens. A piece is <bos>, the meter and key, then each beat as [ ... ] with
+ * its pitches (each followed by its octave), subdivisions as ( ... ) split by "," and a duration when the
+ * beat is longer than one, each measure ending in |, and finally <eos>. token_name gives the vocabulary.
+ * With render_options.repeats, a measure may instead be a single TOK_REPEAT naming an earlier one.
+ */
+typedef enum {
+    TOK_PAD,
+    TOK_BOS,
+    TOK_EOS,
+    TOK_BAR, // End of a measure.
+    TOK_BEAT_OPEN,
+    TOK_BEAT_CLOSE,
+    TOK_SUB_OPEN,
+    TOK_SUB_CLOSE,
+    TOK_SEP,
+    TOK_REST,
+    TOK_PITCH, // 7 letters (C to B) by 6 alters: none, double flat, flat, natural, sharp, double sharp.
+    TOK_OCTAVE = TOK_PITCH + 7 * 6, // Octaves 0 to 9.
+    TOK_DURATION = TOK_OCTAVE + 10, // Beats longer than one, as 1 to 64 whole beats (longer ones are clamped).
+    TOK_BEATS = TOK_DURATION + 64, // Meter numerators 1 to 32.
+    TOK_BEAT_TYPE = TOK_BEATS + 32, // Meter denominators 1, 2, 4, ..., 64.
+    TOK_KEY = TOK_BEAT_TYPE + 7, // Major keys with -7 to 7 fifths, the minor keys likewise, then unknown.
+    TOK_REPEAT = TOK_KEY + 31, // The measure 1 to REPEAT_TOKENS measures back, again.
+    TOK_COUNT = TOK_REPEAT + 32
+} token_id;
+
+static_assert(TOK_COUNT <= 256, "tokens are written one byte each");
+
+const uint32_t REPEAT_TOKENS = 32; // The furthest back a TOK_REPEAT reaches.
+const uint32_t REPEAT_ALL = UINT32_MAX; // render_options.repeats that reaches back to the first measure.
+
+const uint32_t PRINT_RAGGED = 1; // The measure's row was ragged (measure_row.ragged).
+const uint32_t PRINT_ATTRIBUTES = 2; // The measure's XML holds an <attributes>, which later measures may read.
+const uint32_t PRINT_BLANK = 4; // A piece_print between measures that is nothing but whitespace.
+
+// A stretch of a document as a conversion_print sees it: one of its outermost <measure> elements, or the bytes between two.
+typedef struct __pieceprint__ {
+    uint64_t hash;
+    uint64_t flags; // PRINT_ATTRIBUTES for a measure holding an <attributes>, PRINT_BLANK for empty space between two.
+} piece_print;
+
+// One row of the measure table in a conversion_print: where it came from and what it came to.
+typedef struct __measureprint__ {
+    uint64_t input; // Hash of the measure's XML in every part, in document order.
+    uint64_t output; // Hash of the merged measure, or 0 if it was dropped for being empty.
+    uint64_t text_offset; // Its part of the conversion's text.
+    uint64_t text_length;
+    uint32_t measure_num;
+    uint32_t flags; // PRINT_* bits.
+} measure_print;
+
+/**
+ * What reconvert keeps of a document's last conversion, so that the next one only parses, merges and renders
+ * the measures that changed since. text is the conversion itself: a header, every measure in turn and a footer.
+ */
+typedef struct __conversionprint__ {
+    uint64_t frame; // Hash of the render options and of everything but whitespace outside the measures.
+    uint64_t header_length;
+    uint64_t footer_length;
+    file_index index; // The document's <part> and <measure> elements.
+    std::vector<piece_print> pieces; // The document in order: the bytes before its first measure, the measure, ...
+    std::vector<measure_print> measures; // In measure table order.
+    std::string text;
+} conversion_print;
+
+typedef struct __renderoptions__ {
+    bool ml_flag; // Drop octaves and rests (the form used for tokenization).
+    bool tokens; // Write token IDs (token_id, one byte each) instead of text.
+    const char* key_override; // If set, written on the K: line instead of the parsed key.
+    uint32_t repeats; // If not 0, a measure with the same beats as one of the last repeats is written as "=M3" (or TOK_REPEAT).
+    conv_stats* stats; // If set, rendering time and measures written are added to it.
+} render_options;
+
+int open_input(const char* path, input_buffer* buf);
+void close_input(input_buffer* buf);
+
+void init_context(parse_context* ctx);
+void reset_context(parse_context* ctx);
+
+int parse(parse_context* ctx, const input_buffer* input);
+void merge_measures(parse_context* ctx);
+const score* parse_score(parse_context* ctx, const char* data, size_t size);
+int parse_stream(parse_context* ctx, const input_buffer* input, const render_options* opts, FILE* out);
+
+void clear_stats(conv_stats* stats);
+void add_stats(conv_stats* total, const conv_stats* stats);
+std::string stats_json(const conv_stats* stats, const char* file);
+
+int display(const score* piece, const render_options* opts, FILE* out);
+int render(const score* piece, const render_options* opts, std::string* text);
+
+std::string token_name(uint16_t id);
+std::string npy_header(size_t count);
+int expand_repeats(const char* data, size_t size, bool tokens, std::string* text);
+
+score_view view_score(const score* piece);
+int display_view(const score_view* view, const render_options* opts, FILE* out);
+int render_view(const score_view* view, const render_options* opts, std::string* text);
+
+const char* key_name(int8_t key_center, bool major);
+void transpose_score(const score_view* src, int8_t key_center, score* out);
+
+bool is_score_file(const char* data, size_t size);
+int save_score(const score* piece, FILE* out);
+int save_view(const score_view* view, FILE* out);
+int load_score(const char* data, size_t size, score_view* view);
+
+void hash_bytes(const char* data, size_t size, uint64_t seed, uint64_t out[2]);
+
+void select_all(selection* sel);
+bool selects_all(const selection* sel);
+void build_index(const input_buffer* input, file_index* index);
+int save_index(const file_index* index, FILE* out);
+int load_index(const char* data, size_t size, file_index* index);
+
+std::string render_salt(const render_options* opts);
+int reconvert(parse_context* ctx, const input_buffer* input, const render_options* opts, conversion_print* print);
+int save_print(const conversion_print* print, FILE* out);
+int load_print(const char* data, size_t size, conversion_print* print);
+
+// A C interface for loaders that go through a foreign function interface (ctypes, cffi, ...).
+extern "C" {
+parse_context* musicparse_new(void);
+void musicparse_free(parse_context* ctx);
+char* musicparse_convert(parse_context* ctx, const char* data, size_t size, int ml_flag);
+void musicparse_free_text(char* text);
+}
+
+#endif
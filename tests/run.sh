@@ -0,0 +1,147 @@
+#!/bin/bash
+# Converts every tests/*.xml with ./musicparse and compares the output with the .txt next to it, then checks
+# that the other ways of converting a score agree with that output.
+cd "$(dirname "$0")/.." || exit 1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+status=0
+fail() {
+    echo "FAIL $*"
+    status=1
+}
+
+for xml in tests/*.xml; do
+    ./musicparse "$xml" | cmp -s - "${xml%.xml}.txt" || fail "$xml"
+    ./musicparse --stream "$xml" | cmp -s - "${xml%.xml}.txt" || fail "--stream $xml"
+done
+
+# An .mxl archive converts like the score inside it; a truncated one is refused.
+./musicparse tests/minor_key.mxl | cmp -s - tests/minor_key.txt || fail tests/minor_key.mxl
+./musicparse tests/truncated.mxl > /dev/null 2>&1 && fail "tests/truncated.mxl was converted"
+
+# --tokens writes the same symbols as the text, as token IDs: read back through the vocabulary they spell out
+# the text again, less the measure labels and the octave the text gives rests.
+detokenize() {
+    od -An -v -tu1 "$1" | awk -v vocab="$tmp/vocab.txt" '
+        BEGIN { while ((getline line < vocab) > 0) name[n++] = line }
+        { for (i = 1; i <= NF; i++) byte[count++] = $i }
+        END {
+            at = 10 + byte[8] + 256 * byte[9]
+            split(name[byte[at + 1]], beats, "=")
+            split(name[byte[at + 2]], beat_type, "=")
+            key = substr(name[byte[at + 3]], 3)
+            printf "M: %s/%s\nK: %s\n", beats[2], beat_type[2], key == "?" ? "" : key
+            line = ""
+            for (i = at + 4; i < count && name[byte[i]] != "<eos>"; i++) {
+                t = name[byte[i]]
+                if (t == "|") {
+                    print line "|"
+                    line = ""
+                } else if (t == "[") {
+                    line = line (line == "" ? "[" : " [")
+                } else {
+                    line = line (t ~ /^(dur|oct)=/ ? substr(t, 5) : t)
+                }
+            }
+        }'
+}
+./musicparse --vocab "$tmp/vocab.txt"
+for xml in tests/*.xml; do
+    for flag in 0 1; do
+        ./musicparse --tokens "$xml" $flag > "$tmp/tokens.npy"
+        detokenize "$tmp/tokens.npy" | cmp -s - <(./musicparse "$xml" $flag | sed 's/^M[0-9][0-9]*: //; s/ |$/|/; s/R0/R/g') || fail "--tokens $xml $flag"
+    done
+done
+
+# --shards puts each output in a shard as an 8 byte aligned record, which a line of the shard's .idx names
+# along with its key and meter. Counts out of range are refused before anything is written.
+mkdir -p "$tmp/shards/in"
+cp tests/*.xml "$tmp/shards/in"
+./musicparse --batch "$tmp/shards/in" --out "$tmp/shards/out" --shards 3 0 || fail "--shards 3"
+[ "$(cat "$tmp/shards/out"/*.idx | wc -l)" = "$(ls tests/*.xml | wc -l)" ] || fail "--shards 3: index lines"
+for idx in "$tmp/shards/out"/*.idx; do
+    while IFS=$'\t' read -r id offset length key meter; do
+        [ $((offset % 8)) = 0 ] || fail "--shards 3: $id is not aligned"
+        [ "K: $key" = "$(grep '^K:' "tests/$id.txt")" ] && [ "M: $meter" = "$(grep '^M:' "tests/$id.txt")" ] || fail "--shards 3: $id key or meter"
+        tail -c +$((offset + 1)) "${idx%.idx}.bin" | head -c "$length" | cmp -s - "tests/$id.txt" || fail "--shards 3: $id"
+    done < "$idx"
+done
+for bad in "--shards 0" "--shards 1001" "--shards x" "--jobs 0" "--threads 1025"; do
+    ./musicparse --batch "$tmp/shards/in" --out "$tmp/shards/bad" $bad 0 2> /dev/null && fail "$bad was accepted"
+done
+[ -e "$tmp/shards/bad" ] && fail "a refused batch wrote output"
+
+# --parts and --measures give what converting a score holding only those parts and measures does, whether
+# the cache has an index of the file yet or not, and after the file changes under its index.
+mkdir -p "$tmp/select"
+sed '/<score-part id="P1">/d; /<part id="P1">/,/<\/part>/d' tests/cadence.xml > "$tmp/select/bass.xml"
+selected() {
+    local want="$1"
+    shift
+    ./musicparse "$@" tests/cadence.xml | cmp -s - "$want" || fail "$*"
+    # The first run with the cache builds the file's index and the second reads it.
+    ./musicparse --cache "$tmp/select/c" "$@" tests/cadence.xml | cmp -s - "$want" || fail "--cache $* (building the index)"
+    ./musicparse --cache "$tmp/select/c" "$@" tests/cadence.xml | cmp -s - "$want" || fail "--cache $* (with the index)"
+}
+./musicparse "$tmp/select/bass.xml" > "$tmp/select/bass.txt"
+grep -v '^M[14]:' tests/cadence.txt > "$tmp/select/middle.txt"
+grep -v '^M[12]:' tests/cadence.txt > "$tmp/select/end.txt"
+grep -v '^M[14]:' "$tmp/select/bass.txt" > "$tmp/select/bass_middle.txt"
+selected "$tmp/select/middle.txt" --measures 2-3
+selected "$tmp/select/end.txt" --measures 3-
+selected "$tmp/select/bass.txt" --parts 2
+selected "$tmp/select/bass_middle.txt" --parts 2 --measures 2-3
+cp tests/cadence.xml "$tmp/select/score.xml"
+./musicparse --cache "$tmp/select/c" --measures 2-3 "$tmp/select/score.xml" > /dev/null
+sed -i 's/<step>G<\/step><octave>4<\/octave><\/pitch><duration>1</<step>E<\/step><octave>4<\/octave><\/pitch><duration>1</' "$tmp/select/score.xml"
+./musicparse --cache "$tmp/select/c" --measures 2-3 "$tmp/select/score.xml" | cmp -s - <(./musicparse "$tmp/select/score.xml" | grep -v '^M[14]:') || fail "--measures 2-3 after an edit"
+
+# --repeats writes a measure that comes back as a reference to the last time it was heard, as far back as it
+# is told to look, and --expand writes the references out again.
+for xml in tests/*.xml; do
+    for repeats in 2 all; do
+        ./musicparse --repeats $repeats "$xml" > "$tmp/repeats.txt"
+        ./musicparse --expand "$tmp/repeats.txt" | cmp -s - "${xml%.xml}.txt" || fail "--repeats $repeats $xml"
+        ./musicparse --repeats $repeats --tokens "$xml" > "$tmp/repeats.npy"
+        ./musicparse --expand "$tmp/repeats.npy" | cmp -s - <(./musicparse --tokens "$xml") || fail "--repeats $repeats --tokens $xml"
+    done
+done
+[ "$(./musicparse --repeats 2 tests/refrain.xml | grep -c '=M')" = 2 ] || fail "--repeats 2 tests/refrain.xml"
+[ "$(./musicparse --repeats all tests/refrain.xml | grep -c '=M')" = 3 ] || fail "--repeats all tests/refrain.xml"
+
+# A major and a minor chorale with the same number are both written in each key of their mode.
+mkdir -p "$tmp/transpose/001"
+cp tests/implicit_measure.xml "$tmp/transpose/001/Chorale001Bf.xml"
+cp tests/minor_key.xml "$tmp/transpose/001/Chorale002fs.xml"
+./musicparse --batch "$tmp/transpose/001" --out "$tmp/transpose/out" --layout chorales --transpose 12 0
+[ "$(ls "$tmp/transpose/out" | grep -c '_maj$')" = 12 ] || fail "--transpose 12: major keys"
+[ "$(ls "$tmp/transpose/out" | grep -c '_min$')" = 12 ] || fail "--transpose 12: minor keys"
+{ cat tests/minor_key.txt; echo ---; } | cmp -s - "$tmp/transpose/out/g_sharp_min/001.txt" || fail "--transpose 12: g_sharp_min/001.txt"
+
+# Converting from the cache after an edit gives what a cold conversion of the edited file does, whatever state
+# the print of the last conversion (the .prt file) is in.
+score="$tmp/cache/score.xml"
+mkdir -p "$tmp/cache"
+cp tests/cadence.xml "$score"
+./musicparse --cache "$tmp/cache/c" "$score" > /dev/null
+stale="$tmp/cache/stale.prt"
+cp "$(find "$tmp/cache/c" -name '*.prt')" "$stale"
+cached() {
+    ./musicparse --cache "$tmp/cache/c" "$score" | cmp -s - <(./musicparse "$score") || fail "--cache after $1"
+}
+sed -i 's/<step>G<\/step><octave>4<\/octave><\/pitch><duration>1</<step>E<\/step><octave>4<\/octave><\/pitch><duration>1</' "$score"
+cached "a changed step"
+sed -i '/<part id="P2">/,/<\/part>/s/<measure number="3">/&<attributes><divisions>2<\/divisions><\/attributes>/' "$score"
+cached "an inserted <attributes>"
+sed -i '/<part id="P1">/,/<\/part>/{/<measure number="3">/,/<\/measure>/d}' "$score"
+cached "a deleted measure"
+sed -i 's/number="4"/number="5"/' "$score"
+cached "renumbered measures"
+cp "$stale" "$(find "$tmp/cache/c" -name '*.prt')"
+sed -i 's/<step>D<\/step><octave>3/<step>E<\/step><octave>3/' "$score"
+cached "an edit with a stale print"
+printf 'MPPRINT garbage' > "$(find "$tmp/cache/c" -name '*.prt')"
+sed -i 's/<step>C<\/step><octave>5/<step>D<\/step><octave>5/' "$score"
+cached "an edit with a corrupt print"
+
+exit $status